@@ -5,6 +5,16 @@
 #include <limits.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* The JITs generate x86-64 code, and use mmap() to get memory they can
+ * execute. Define AOCLA_NO_JIT to disable them anyway. */
+#if defined(__x86_64__) && defined(__linux__) && !defined(AOCLA_NO_JIT) && \
+    !defined(AOCLA_SEQ_STATS)
+#define AOCLA_JIT
+#include <sys/mman.h>
+#endif
 
 #define NOTUSED(V) ((void) V)
 
@@ -24,18 +34,25 @@
 #define OBJ_TYPE_SYMBOL (1<<4)
 #define OBJ_TYPE_BOOL   (1<<5)
 #define OBJ_TYPE_ANY    INT_MAX /* All bits set. For checkStackType(). */
+#define OBJ_REFCOUNT_IMMORTAL INT_MAX /* Shared objects never freed. */
 typedef struct obj {
     int type;       /* OBJ_TYPE_... */
-    int refcount;   /* Reference count. */
+    int refcount;   /* Reference count, or OBJ_REFCOUNT_IMMORTAL. */
     int line;       /* Source code line number where this was defined, or 0. */
     union {
-        int i;      /* Integer. Literal: 1234 */
-        int istrue; /* Boolean. Literal: #t or #f */
+        int i;      /* Boxed integer, see newInt(). */
         struct {    /* List or Tuple: Literal: [1 2 3 4] or (a b c) */
             struct obj **ele;
             size_t len;
+            size_t head;    /* Free slots allocated before 'ele'. */
+            size_t alloc;   /* Total slots allocated, 'head' included. */
             int quoted; /* Used for quoted tuples. Don't capture vars if true.
                            Just push the tuple on stack. */
+            struct code *code; /* Compiled form of the list, or NULL if
+                                  the list was never evaluated. */
+            struct vnode *tree; /* If not NULL, the elements are stored
+                                   in this tree and 'ele' is NULL. See
+                                   the persistent lists section. */
         } l;
         struct {    /* Mutable string & unmutable symbol. */
             char *ptr;
@@ -43,45 +60,336 @@ typedef struct obj {
             int quoted; /* Used for quoted symbols: when quoted they are
                            not executed, but just pushed on the stack by
                            eval(). */
+            struct aproc *proc; /* Procedure this symbol resolved to the
+                                   last time it was called, valid only
+                                   if 'epoch' matches the context one. */
+            uint64_t epoch;
         } str;
     };
 } obj;
 
+/* Integers and booleans are not allocated as objects: they are stored
+ * directly inside the obj pointer, using the low bits of the pointer (that
+ * are always zero for real objects, since they are aligned) as a tag.
+ * This way pushing, capturing, storing in lists, and releasing integers
+ * and booleans requires no memory allocation nor refcount updates.
+ *
+ * Integers have the lowest bit set and the value in the other bits.
+ * Booleans have the tag 10 (binary) and the value in the third bit.
+ * Only on systems where pointers are not larger than 'int', integers not
+ * fitting in the pointer bits are allocated as OBJ_TYPE_INT objects.
+ *
+ * Code should never access the type and the value of objects that may be
+ * integers or booleans directly, but use the following macros. Note that
+ * the macros may evaluate their argument multiple times. */
+#define OBJ_TAG_MASK 3
+#define OBJ_TAG_INT 1
+#define OBJ_TAG_BOOL 2
+#define IS_IMMEDIATE(o) (((uintptr_t)(o)) & OBJ_TAG_MASK)
+#define OBJ_TYPE(o) ((((uintptr_t)(o)) & OBJ_TAG_INT) ? OBJ_TYPE_INT : \
+                     (((uintptr_t)(o)) & OBJ_TAG_BOOL) ? OBJ_TYPE_BOOL : \
+                     (o)->type)
+#define INT_VALUE(o) ((((uintptr_t)(o)) & OBJ_TAG_INT) ? \
+                      (int)(((intptr_t)(o)) >> 1) : (o)->i)
+#define BOOL_VALUE(o) ((int)(((uintptr_t)(o)) >> 2))
+#define IMMEDIATE_INT(i) ((obj*)((((uintptr_t)(intptr_t)(i)) << 1) | \
+                                 OBJ_TAG_INT))
+#define IMMEDIATE_BOOL(b) ((obj*)((uintptr_t)(((b) != 0) << 2 | \
+                                               OBJ_TAG_BOOL)))
+#define IMMEDIATE_INT_MAX (INTPTR_MAX >> 1)
+#define IMMEDIATE_INT_MIN (INTPTR_MIN >> 1)
+
+/* Lists are compiled into bytecode the first time they are evaluated,
+ * and the compiled form is cached inside the list object itself, so that
+ * procedure bodies, and the literal lists inside them used as code by
+ * if, while and so forth, are only compiled once. Each element of the
+ * list becomes an instruction with its operand already decoded, so that
+ * the VM does not need to inspect the object type, the quoted flag or the
+ * '$' prefix of symbols at every execution. */
+#define OP_PUSH     0   /* Push the object 'o' on the stack. */
+#define OP_LOCAL    1   /* Push the local var 'var' on the stack. */
+#define OP_CAPTURE  2   /* Capture stack values into the tuple 'o' vars. */
+#define OP_CALL     3   /* Call the procedure named as the symbol 'o'. */
+#define OP_RETURN   4   /* End of the compiled list. */
+
+/* Superinstructions: common sequences starting with OP_LOCAL fused into a
+ * single instruction by optimizeCode(). The instructions of the sequence
+ * are left in place after the superinstruction, that reads its operands
+ * from them. If the fast path can't be used (types are not the expected
+ * ones, or the procedure called was redefined by the user), the
+ * sequence is executed normally, as if it was not fused. */
+#define OP_LOCAL2           5   /* $a $b */
+#define OP_LOCAL_MATH       6   /* $a <int> + (or - *) */
+#define OP_LOCAL_MATH_SET   7   /* $a <int> + (a) */
+#define OP_LOCAL_CMP        8   /* $a $b < (or <int>, and any comparison) */
+#define OP_LOCAL_GET        9   /* $a $b get@ */
+
+/* Quickened calls: the first time an OP_CALL of an arithmetic or
+ * comparison operator is executed, it is rewritten in place into one of
+ * the following opcodes, specialized for the types of the operands found
+ * on the stack, and with the operator stored in 'var'. If later the
+ * operands have different types, or the operator was redefined, the
+ * instruction is turned back into a generic OP_CALL. */
+#define OP_CALL_INT_MATH    10  /* int int + - * / */
+#define OP_CALL_INT_CMP     11  /* int int < <= > >= == != */
+#define OP_CALL_STR_CMP     12  /* string string < <= > >= == != */
+
+/* Constant folding: the first instruction of a sequence computing a
+ * constant value is turned into OP_CONST by foldConstants(), pushing the
+ * precomputed value and skipping the sequence. Like for the
+ * superinstructions, the instructions are left in place. */
+#define OP_CONST            13  /* Push 'aux', skip 'var' instructions. */
+
+/* Inlining: calls to small Aocla procedures are turned into OP_INLINE
+ * by inlineCalls(), jumping to a copy of the procedure code appended
+ * after the OP_RETURN of the caller, and ending with an OP_JUMP back. */
+#define OP_INLINE           14  /* Jump to 'var' if 'o' is still bound
+                                   to the procedure 'aux'. */
+#define OP_JUMP             15  /* Continue from instruction 'var'. */
+
+/* Baseline JIT: instructions compiled to native code by compileNative()
+ * keep their opcode, but are dispatched to the VM code of OP_NATIVE,
+ * that is never stored in 'op'. */
+#define OP_NATIVE           16
+#define OP_COUNT            17
+
+/* When the compiler supports labels as values (GCC and clang), the VM
+ * uses direct threading: each instruction stores the address of the VM
+ * code implementing it, so that dispatching the next instruction is a
+ * single indirect jump, that the CPU can predict separately for each
+ * opcode. Otherwise a switch is used. Define AOCLA_NO_COMPUTED_GOTO to
+ * use the switch anyway. */
+#if defined(__GNUC__) && !defined(AOCLA_NO_COMPUTED_GOTO)
+#define AOCLA_COMPUTED_GOTO
+#endif
+
+/* The baseline JIT marks the instructions having native code changing
+ * their label, so it needs direct threading. */
+#if defined(AOCLA_JIT) && defined(AOCLA_COMPUTED_GOTO)
+#define AOCLA_BASELINE_JIT
+#endif
+
+typedef struct instr {
+#ifdef AOCLA_COMPUTED_GOTO
+    void *label;    /* Address of the VM code implementing 'op'. */
+#endif
+    int op;         /* OP_... */
+    int line;       /* Line number of the original list element. */
+    int var;        /* Local var name for OP_LOCAL. For calls fused in
+                       superinstructions, the name of the operator. */
+    obj *o;         /* Object operand: literal, tuple or symbol. */
+    const struct builtin *checked; /* For OP_CALL, the builtin whose
+                       arguments analyzeList() proved to be valid. */
+    obj *aux;       /* For OP_CONST, the value of the folded sequence.
+                       For OP_INLINE, the list of the inlined procedure. */
+} instr;
+
+typedef struct code {
+    int refcount;   /* The VM retains the code while executing it. */
+    size_t len;     /* Number of instructions, OP_RETURN and the inlined
+                       procedures after it included. */
+    instr *ins;     /* Instructions array. */
+    int numvars;    /* Distinct local vars captured by the list and the
+                       lists nested inside it. Used to size frames. */
+    int runscode;   /* True if the list may run code accessing the frame
+                       of its caller, see listRunsCode(). */
+    int stale;      /* True if some inlined procedure was redefined: the
+                       list will be compiled again. */
+#ifdef AOCLA_JIT
+    int hotness;    /* Iterations of while loops having this list as body,
+                       or -1 if the loop can't be traced. */
+    struct trace *trace; /* Native code of the loop, or NULL. */
+#endif
+#ifdef AOCLA_BASELINE_JIT
+    int calls;      /* Executions, counted up to AOCLA_BASELINE_THRESHOLD,
+                       when the code is compiled to native code. */
+    struct native *native; /* Native code of the instructions, or NULL. */
+#endif
+} code;
+
+/* Nodes of the persistent lists trees: see the persistent lists
+ * section for more information. */
+#define VNODE_LEAF_MAX 32       /* Max elements in a leaf. */
+#define LIST_TREE_MIN_LEN 256   /* Min len to switch to the tree. */
+
+typedef struct vnode {
+    int refcount;
+    int height;                 /* 0 for leaves. */
+    size_t size;                /* Number of elements in the subtree. */
+    struct vnode *left, *right; /* Children of inner nodes. */
+    obj *ele[];                 /* Elements of leaves. */
+} vnode;
+
+/* Builtin procedures implemented in C are described by a signature:
+ * the number of arguments they consume from the stack, the type of each
+ * argument and the number of values they push. The VM checks the
+ * arguments against the signature before calling the procedure, so
+ * the C implementations can assume the arguments are valid.
+ *
+ * The type masks of the arguments are packed in a single 32 bit vector,
+ * one byte per argument, starting from the deepest one in the least
+ * significant byte. Since an object has a single type bit set, packing
+ * the types of the actual arguments the same way, the check is just
+ * (types & ~argtypes) == 0. */
+#define BUILTIN_MAX_ARGS 4
+#define BUILTIN_ANY_RET -1      /* The stack effect depends on the code
+                                   executed, as for if, eval, ... */
+#define ARGS0 0, 0
+#define ARGS1(a) 1, (uint32_t)((a)&0xff)
+#define ARGS2(a,b) 2, ((uint32_t)((a)&0xff) | (uint32_t)((b)&0xff)<<8)
+#define ARGS3(a,b,c) 3, ((uint32_t)((a)&0xff) | (uint32_t)((b)&0xff)<<8 | \
+                         (uint32_t)((c)&0xff)<<16)
+#define BUILTIN_ARGTYPE(b,j) ((int)(((b)->argtypes >> ((j)*8)) & 0xff))
+
+struct aoclactx;
+typedef struct builtin {
+    const char *name;
+    int (*cproc)(struct aoclactx *);
+    int argc;           /* Arguments consumed from the stack. */
+    uint32_t argtypes;  /* Packed type masks of the arguments. */
+    int retc;           /* Values pushed, or BUILTIN_ANY_RET. */
+    int rettype;        /* Type mask of the values pushed. */
+    int op;             /* For arithmetic and comparison operators, the
+                           operator code the VM uses for the fast paths,
+                           see callOperator(). Otherwise zero. */
+} builtin;
+
 /* Procedures. They are just lists with associated names. There are also
  * procedures implemented in C. In this case proc is NULL and cproc has
  * the value of the function pointer implementing the procedure. */
-struct aoclactx;
 typedef struct aproc {
-    const char *name;
+    const char *name;  /* Interned, see internSymbol(). */
     obj *proc;      /* If not NULL it's an Aocla procedure (list object). */
     int (*cproc)(struct aoclactx *); /* C procedure. */
-    struct aproc *next;
+    const builtin *builtin; /* Signature of C procedures, or NULL. */
 } aproc;
 
+/* Procedures are stored into an open addressing hash table with linear
+ * probing. When the table gets too full we allocate a table of double
+ * the size and migrate the procedures incrementally, a few slots at every
+ * lookup, like Redis does with its dictionaries: this way defining a
+ * procedure never has to pay for rehashing the whole table at once.
+ * Procedures are never deleted (redefining a procedure reuses the same
+ * aproc structure), so we don't need tombstones. */
+#define PROCTABLE_INITIAL_SIZE 64       /* Must be a power of two. */
+#define PROCTABLE_REHASH_STEPS 4        /* Slots migrated per operation. */
+typedef struct proctable {
+    aproc **table;  /* Array of 'size' slots, NULL if empty. */
+    size_t size;    /* Always a power of two. */
+    size_t used;    /* Number of procedures stored. */
+} proctable;
+
 /* We have local vars, so we need a stack frame. We start with a top level
  * stack frame. Each time a procedure is called, we create a new stack frame
- * and free it once the procedure returns. */
-#define AOCLA_NUMVARS 256
+ * and free it once the procedure returns.
+ *
+ * Procedures usually bind just a few vars, so instead of having a slot
+ * for each possible var name, frames have a small array of name/value
+ * pairs that we scan linearly. The array is allocated only when the first
+ * var is bound, with the size the procedure needs according to its
+ * tuples, and can grow later (upeval can bind vars in any frame).
+ * Frames are recycled via a per interpreter pool, together with their
+ * vars array, so calling a procedure usually allocates nothing. */
+typedef struct localvar {
+    obj *val;
+    int name;                  /* Var name, a single byte. */
+} localvar;
+
 typedef struct stackframe {
-    obj *locals[AOCLA_NUMVARS];/* Local var names are limited to a,b,c,...,z. */
+    localvar *vars;            /* Bound vars, or NULL if never used. */
+    int numvars;               /* Number of bound vars. */
+    int allocvars;             /* Size of the vars array. */
+    int sizehint;              /* Vars the procedure is expected to bind. */
     aproc *curproc;            /* Current procedure executing or NULL.  */
     int curline;               /* Current line number during execution. */
     struct stackframe *prev;   /* Upper level stack frame or NULL. */
 } stackframe;
 
+/* Continuations. The VM does not use the C stack to call procedures or
+ * to evaluate lists: what is left to do once the code being executed
+ * returns is saved in a stack of continuations, allocated on the heap.
+ * When the code returns, the VM pops and resumes the top continuation.
+ * Procedures implemented in C that need to evaluate code, like if or
+ * map, push a continuation with a 'resume' callback, and ask the VM to
+ * execute the code with vmJump(). See vmExec() for more info. */
+#define CONT_PROC  0    /* Procedure return: free the procedure frame,
+                           restore the caller frame and resume its code
+                           if any. */
+#define CONT_CODE  1    /* Resume code 'c' at 'ip'. */
+#define CONT_CPROC 2    /* Call 'resume'. */
+#ifndef AOCLA_MAX_DEPTH
+#define AOCLA_MAX_DEPTH 1000000 /* Default max number of continuations. */
+#endif
+typedef struct cont {
+    int type;           /* CONT_... */
+    code *c;            /* Code to resume or NULL. Retained. */
+    instr *ip;          /* Next instruction to execute in 'c'. */
+    stackframe *frame;  /* Frame to restore when popped, or NULL. */
+    aproc *curproc;     /* CONT_CODE: frame->curproc to restore.
+                           CONT_CPROC: the procedure that created it. */
+    int (*resume)(struct aoclactx *ctx, struct cont *k);
+    obj *a, *b, *r;     /* CONT_CPROC state, released when popped. */
+    size_t idx;         /* CONT_CPROC state. */
+} cont;
+
 /* Interpreter state. */
 #define ERRSTR_LEN 256
+#ifndef AOCLA_STACK_INITIAL_SIZE
+#define AOCLA_STACK_INITIAL_SIZE 64 /* Initial stack slots. */
+#endif
 typedef struct aoclactx {
     size_t stacklen;        /* Stack current len. */
+    size_t stackalloc;      /* Number of stack slots allocated. */
     obj **stack;
-    aproc *proc;            /* Defined procedures. */
+    proctable proc[2];      /* Defined procedures. proc[1] is only used
+                               while rehashing. */
+    long rehashidx;         /* Next proc[0] slot to migrate or -1. */
     stackframe *frame;      /* Stack frame with locals. */
+    stackframe *freeframes; /* Pool of frames to reuse, linked by 'prev'. */
+    cont *cont;             /* Continuations stack. */
+    size_t contlen;         /* Number of continuations in the stack. */
+    size_t contalloc;       /* Continuations allocated. */
+    size_t maxdepth;        /* Max continuations, to raise an error
+                               instead of consuming all the memory. */
+    code *jump;             /* Code to execute next, see vmJump(). */
+    uint64_t epoch;         /* Incremented every time a procedure is
+                               redefined, to invalidate the procedures
+                               cached inside symbols. Starts at 1. */
     /* Syntax error context. */
     char errstr[ERRSTR_LEN]; /* Syntax error or execution error string. */
 } aoclactx;
 
 void setError(aoclactx *ctx, const char *ptr, const char *msg);
 aproc *lookupProc(aoclactx *ctx, const char *name);
+aproc *lookupProcSymbol(aoclactx *ctx, const char *name);
+void procTableInit(proctable *t, size_t size);
+void releaseCode(code *c);
+code *getListCode(aoclactx *ctx, obj *l);
+#ifdef AOCLA_JIT
+void releaseTrace(struct trace *t);
+#endif
+#ifdef AOCLA_BASELINE_JIT
+void countExecution(aoclactx *ctx, code *c);
+void releaseNative(struct native *n);
+instr *runNative(aoclactx *ctx, code *c, instr *ip);
+#endif
+void vnodeRelease(struct vnode *n);
+obj *listGet(obj *l, size_t idx);
+void listToTree(obj *l);
+obj *newInt(int i);
+obj *newBool(int b);
+int eval(aoclactx *ctx, obj *l);
+int vmExec(aoclactx *ctx, code *c);
+struct code *compileList(aoclactx *ctx, obj *l, const int *locals);
+int procListGetAt(aoclactx *ctx);
+int procDup(aoclactx *ctx);
+int procSwap(aoclactx *ctx);
+int procDrop(aoclactx *ctx);
+int builtinOp(aproc *proc);
+int matchBuiltinArgs(aoclactx *ctx, const builtin *b);
+int checkBuiltinArgs(aoclactx *ctx, const builtin *b);
+extern const builtin Builtins[];
+extern _Thread_local int BuiltinsRedefined;
 void loadLibrary(aoclactx *ctx);
 
 /* ================================= Utils ================================== */
@@ -106,46 +414,339 @@ void *myrealloc(void *ptr, size_t size) {
     return p;
 }
 
+/* =========================== Memory allocator =============================
+ * Aocla allocates and frees objects all the time: every integer produced
+ * by math, every boolean produced by comparisons, and so forth. Instead of
+ * going to malloc() every time, objects and small buffers (the elements
+ * array of lists and the bytes of strings) are carved out of big slabs
+ * and recycled via free lists, one for objects and one for each power of
+ * two buffer size class. Slabs are never returned to the system.
+ *
+ * The allocator state is per thread, so that interpreters can run in
+ * different threads without locking, as long as the objects of an
+ * interpreter are only used by the thread that created it.
+ *
+ * Buffers are prefixed by an header with their size class, so that they
+ * can be freed and reallocated without passing their size around. Buffers
+ * bigger than the biggest class just use malloc().
+ *
+ * When compiling with the address sanitizer slabs are not used, so that
+ * memory errors can still be detected.
+ * ========================================================================== */
+
+#if defined(__SANITIZE_ADDRESS__) && !defined(AOCLA_NO_SLAB)
+#define AOCLA_NO_SLAB
+#endif
+
+#define SLAB_SIZE (64*1024)     /* Bytes allocated with malloc() per slab. */
+#define BUF_CLASSES 6           /* Classes of 16, 32, 64, ... 512 bytes. */
+#define BUF_MIN_SIZE 16         /* Smallest class size, header included. */
+#define BUF_LARGE BUF_CLASSES   /* Class of buffers allocated via malloc(). */
+
+typedef struct freechunk {
+    struct freechunk *next;
+} freechunk;
+
+typedef struct bufhdr {
+    size_t class;               /* Size class, or BUF_LARGE. */
+    size_t size;                /* Usable size, header excluded. */
+} bufhdr;
+
+_Thread_local struct {
+    freechunk *objfree;         /* Free objects. */
+    freechunk *buffree[BUF_CLASSES]; /* Free buffers for each class. */
+    size_t objslabs;            /* Slabs allocated for objects. */
+    size_t objused;             /* Objects in use. */
+    size_t bufslabs[BUF_CLASSES]; /* Slabs allocated for each class. */
+    size_t bufused[BUF_CLASSES];  /* Buffers in use for each class. */
+    size_t largeused;           /* Buffers in use allocated via malloc(). */
+    size_t vnodes;              /* Persistent lists tree nodes. */
+} Allocator;
+
+/* Allocate a new slab and split it into chunks of 'size' bytes, populating
+ * the free list '*list'. */
+void slabRefill(freechunk **list, size_t size) {
+    char *slab = myalloc(SLAB_SIZE);
+    for (size_t off = 0; off+size <= SLAB_SIZE; off += size) {
+        freechunk *fc = (freechunk*)(slab+off);
+        fc->next = *list;
+        *list = fc;
+    }
+}
+
+/* Allocate 'size' bytes for an object. 'size' must always be the same,
+ * that is, sizeof(obj). */
+void *objAlloc(size_t size) {
+    Allocator.objused++;
+#ifdef AOCLA_NO_SLAB
+    return myalloc(size);
+#else
+    if (Allocator.objfree == NULL) {
+        slabRefill(&Allocator.objfree,size);
+        Allocator.objslabs++;
+    }
+    freechunk *fc = Allocator.objfree;
+    Allocator.objfree = fc->next;
+    return fc;
+#endif
+}
+
+/* Return an object allocated with objAlloc() to the free list. */
+void objFree(void *ptr) {
+    Allocator.objused--;
+#ifdef AOCLA_NO_SLAB
+    free(ptr);
+#else
+    freechunk *fc = ptr;
+    fc->next = Allocator.objfree;
+    Allocator.objfree = fc;
+#endif
+}
+
+/* Allocate a buffer able to hold 'size' bytes. */
+void *bufAlloc(size_t size) {
+    size_t class = 0, chunksize = BUF_MIN_SIZE;
+    while(class < BUF_CLASSES && chunksize-sizeof(bufhdr) < size) {
+        class++;
+        chunksize <<= 1;
+    }
+#ifdef AOCLA_NO_SLAB
+    class = BUF_LARGE;
+#endif
+
+    bufhdr *hdr;
+    if (class == BUF_LARGE) {
+        hdr = myalloc(sizeof(bufhdr)+size);
+        hdr->size = size;
+        Allocator.largeused++;
+    } else {
+        if (Allocator.buffree[class] == NULL) {
+            slabRefill(&Allocator.buffree[class],chunksize);
+            Allocator.bufslabs[class]++;
+        }
+        hdr = (bufhdr*)Allocator.buffree[class];
+        Allocator.buffree[class] = Allocator.buffree[class]->next;
+        hdr->size = chunksize-sizeof(bufhdr);
+        Allocator.bufused[class]++;
+    }
+    hdr->class = class;
+    return hdr+1;
+}
+
+/* Free a buffer allocated with bufAlloc(). NULL is a no-op. */
+void bufFree(void *ptr) {
+    if (ptr == NULL) return;
+    bufhdr *hdr = (bufhdr*)ptr-1;
+    if (hdr->class == BUF_LARGE) {
+        Allocator.largeused--;
+        free(hdr);
+    } else {
+        size_t class = hdr->class;
+        freechunk *fc = (freechunk*)hdr; /* Overwrites the header. */
+        fc->next = Allocator.buffree[class];
+        Allocator.buffree[class] = fc;
+        Allocator.bufused[class]--;
+    }
+}
+
+/* Like realloc() for buffers allocated with bufAlloc(). As a special case
+ * a NULL 'ptr' allocates a new buffer. */
+void *bufRealloc(void *ptr, size_t size) {
+    if (ptr == NULL) return bufAlloc(size);
+    bufhdr *hdr = (bufhdr*)ptr-1;
+    if (size <= hdr->size) return ptr; /* Still fits the current chunk. */
+    if (hdr->class == BUF_LARGE) {
+        hdr = myrealloc(hdr,sizeof(bufhdr)+size);
+        hdr->size = size;
+        return hdr+1;
+    }
+    void *newptr = bufAlloc(size);
+    memcpy(newptr,ptr,hdr->size);
+    bufFree(ptr);
+    return newptr;
+}
+
+/* Show the allocator statistics. */
+void allocatorShowStats(void) {
+    size_t objslabcount = SLAB_SIZE/sizeof(obj);
+    printf("objects: %zu used, %zu slabs (%zu objects capacity)\n",
+        Allocator.objused, Allocator.objslabs,
+        Allocator.objslabs*objslabcount);
+    for (int j = 0; j < BUF_CLASSES; j++) {
+        size_t chunksize = BUF_MIN_SIZE << j;
+        printf("buffers %zu bytes: %zu used, %zu slabs "
+               "(%zu buffers capacity)\n",
+            chunksize, Allocator.bufused[j], Allocator.bufslabs[j],
+            Allocator.bufslabs[j]*(SLAB_SIZE/chunksize));
+    }
+    printf("large buffers: %zu used\n", Allocator.largeused);
+    printf("list tree nodes: %zu used\n", Allocator.vnodes);
+}
+
+/* Hash function for symbol names. This is the FNV-1a hash. */
+unsigned int hashString(const char *s, size_t len) {
+    unsigned int h = 2166136261U;
+    for (size_t j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* ============================ Symbols table ===============================
+ * Symbol names are interned: every occurrence of the same symbol, in any
+ * program and in any interpreter of the thread (the table is per thread,
+ * like the allocator state), points to the same null terminated
+ * string, that is preceded in memory by an header with its length and
+ * hash (like the Redis SDS strings do). Two symbols are the same symbol
+ * if their pointers are the same, and procedures are looked up by pointer.
+ *
+ * Interned names are immutable and never freed: the set of symbols of a
+ * program is small and bounded by its source code, with the exception of
+ * symbols created at runtime with cat.
+ * ========================================================================== */
+
+typedef struct symhdr {
+    unsigned int hash;  /* hashString() of the name. */
+    size_t len;         /* Length of the name, excluding the nullterm. */
+    char name[];        /* Null terminated name. */
+} symhdr;
+
+#define SYMHDR(p) ((symhdr*)((p)-offsetof(symhdr,name)))
+#define SYMTABLE_INITIAL_SIZE 1024 /* Must be a power of two. */
+
+_Thread_local struct {
+    symhdr **table;     /* Open addressing table, linear probing. */
+    size_t size;        /* Always a power of two. */
+    size_t used;        /* Number of interned symbols. */
+} SymbolsTable;
+
+/* Store 'sh' in the symbols table slots, that must have a free slot. */
+void symbolsTableAdd(symhdr *sh) {
+    size_t mask = SymbolsTable.size-1;
+    size_t idx = sh->hash & mask;
+    while(SymbolsTable.table[idx]) idx = (idx+1) & mask;
+    SymbolsTable.table[idx] = sh;
+}
+
+/* Return the interned version of the symbol name 's' of length 'len'. */
+const char *internSymbol(const char *s, size_t len) {
+    unsigned int hash = hashString(s,len);
+    size_t mask = SymbolsTable.size-1;
+    symhdr *sh;
+
+    if (SymbolsTable.table) {
+        size_t idx = hash & mask;
+        while((sh = SymbolsTable.table[idx]) != NULL) {
+            if (sh->hash == hash && sh->len == len &&
+                memcmp(sh->name,s,len) == 0) return sh->name;
+            idx = (idx+1) & mask;
+        }
+    }
+
+    /* Not found: grow the table if needed (we keep it at most half full),
+     * then add the new symbol. */
+    if (SymbolsTable.used*2 >= SymbolsTable.size) {
+        symhdr **old = SymbolsTable.table;
+        size_t oldsize = SymbolsTable.size;
+        SymbolsTable.size = oldsize ? oldsize*2 : SYMTABLE_INITIAL_SIZE;
+        SymbolsTable.table = myalloc(sizeof(symhdr*)*SymbolsTable.size);
+        memset(SymbolsTable.table,0,sizeof(symhdr*)*SymbolsTable.size);
+        for (size_t j = 0; j < oldsize; j++)
+            if (old[j]) symbolsTableAdd(old[j]);
+        free(old);
+    }
+    sh = myalloc(sizeof(symhdr)+len+1);
+    sh->hash = hash;
+    sh->len = len;
+    memcpy(sh->name,s,len);
+    sh->name[len] = 0;
+    symbolsTableAdd(sh);
+    SymbolsTable.used++;
+    return sh->name;
+}
+
 /* =============================== Objects ================================== */
 
-/* Recursively free an Aocla object, if the refcount just dropped to zero. */
+/* Recursively free an Aocla object, if the refcount just dropped to zero.
+ * Integers and booleans are not allocated, so this is a no-op for them,
+ * and so it is for immortal objects. */
 void release(obj *o) {
-    if (o == NULL) return;
+    if (o == NULL || IS_IMMEDIATE(o) ||
+        o->refcount == OBJ_REFCOUNT_IMMORTAL) return;
     assert(o->refcount >= 0);
     if (--o->refcount == 0) {
         switch(o->type) {
         case OBJ_TYPE_LIST:
         case OBJ_TYPE_TUPLE:
-            for (size_t j = 0; j < o->l.len; j++)
-                release(o->l.ele[j]);
-            free(o->l.ele);
+            if (o->l.tree) {
+                vnodeRelease(o->l.tree);
+            } else {
+                for (size_t j = 0; j < o->l.len; j++)
+                    release(o->l.ele[j]);
+                bufFree(o->l.ele ? o->l.ele-o->l.head : NULL);
+            }
+            if (o->l.code) releaseCode(o->l.code);
             break;
-        case OBJ_TYPE_SYMBOL:
         case OBJ_TYPE_STRING:
-            free(o->str.ptr);
+            bufFree(o->str.ptr);
             break;
         default:
             break;
-            /* Nothing special to free. */
+            /* Nothing special to free. Symbol names are interned. */
         }
-        free(o);
+        objFree(o);
     }
 }
 
 /* Increment the object ref count. Use when a new reference is created. */
 void retain(obj *o) {
+    if (IS_IMMEDIATE(o) || o->refcount == OBJ_REFCOUNT_IMMORTAL) return;
     o->refcount++;
 }
 
 /* Allocate a new object of type 'type. */
 obj *newObject(int type) {
-    obj *o = myalloc(sizeof(*o));
+    obj *o = objAlloc(sizeof(*o));
     o->refcount = 1;
     o->type = type;
     o->line = 0;
     return o;
 }
 
+/* Make sure the list (or tuple) 'l' has room for 'count' more elements
+ * at its tail (where == LIST_TAIL) or before its first element
+ * (where == LIST_HEAD). The allocation grows geometrically, so that
+ * appending N elements, on either side, is amortized O(N). When making
+ * room at the head, the new free slots are created before the first
+ * element, moving the elements once, so that the following prepends
+ * just need to move the 'ele' pointer back. */
+#define LIST_TAIL 0
+#define LIST_HEAD 1
+void listMakeRoom(obj *l, size_t count, int where) {
+    obj **buf = l->l.ele ? l->l.ele - l->l.head : NULL;
+    size_t tailroom = l->l.alloc - l->l.head - l->l.len;
+    if (where == LIST_TAIL) {
+        if (tailroom >= count) return;
+        size_t newalloc = (l->l.head+l->l.len+count)*2;
+        if (newalloc < 4) newalloc = 4;
+        buf = bufRealloc(buf,sizeof(obj*)*newalloc);
+        l->l.alloc = newalloc;
+    } else {
+        if (l->l.head >= count) return;
+        size_t newhead = (l->l.len+count)*2;
+        size_t newalloc = newhead+l->l.len+tailroom;
+        obj **newbuf = bufAlloc(sizeof(obj*)*newalloc);
+        if (l->l.len)
+            memcpy(newbuf+newhead,l->l.ele,sizeof(obj*)*l->l.len);
+        bufFree(buf);
+        buf = newbuf;
+        l->l.head = newhead;
+        l->l.alloc = newalloc;
+    }
+    l->l.ele = buf + l->l.head;
+}
+
 /* Return true if the character 'c' is within the Aocla symbols charset. */
 int issymbol(int c) {
     if (isalpha(c)) return 1;
@@ -192,23 +793,34 @@ const char *parserConsumeSpace(const char *s, int *line) {
  *
  * Returned object has a ref count of 1. */
 obj *parseObject(aoclactx *ctx, const char *s, const char **next, int *line) {
-    obj *o = newObject(-1);
-
     /* Consume empty space and comments. */
     s = parserConsumeSpace(s,line);
-    if (line)
-        o->line = *line; /* Set line number where this object is defined. */
 
+    /* Integers and booleans are immediate values, see newInt(), so they
+     * don't have a line number, and are handled before allocating the
+     * object. */
     if ((s[0] == '-' && isdigit(s[1])) || isdigit(s[0])) { /* Integer. */
         char buf[64];
         size_t len = 0;
         while((*s == '-' || isdigit(*s)) && len < sizeof(buf)-1)
             buf[len++] = *s++;
         buf[len] = 0;
-        o->type = OBJ_TYPE_INT;
-        o->i = atoi(buf);
         if (next) *next = s;
-    } else if (s[0] == '[' || /* List, tuple or quoted tuple. */
+        return newInt(atoi(buf));
+    } else if (s[0]=='#') {             /* Boolean. */
+        if (s[1] != 't' && s[1] != 'f') {
+            setError(ctx,s,"Booelans are either #t or #f");
+            return NULL;
+        }
+        if (next) *next = s+2;
+        return newBool(s[1] == 't');
+    }
+
+    obj *o = newObject(-1);
+    if (line)
+        o->line = *line; /* Set line number where this object is defined. */
+
+    if (s[0] == '[' || /* List, tuple or quoted tuple. */
                s[0] == '(' ||
                (s[0] == '\'' && s[1] == '('))
     {
@@ -219,8 +831,10 @@ obj *parseObject(aoclactx *ctx, const char *s, const char **next, int *line) {
             o->l.quoted = 0;
         }
         o->type = s[0] == '[' ? OBJ_TYPE_LIST : OBJ_TYPE_TUPLE;
-        o->l.len = 0;
+        o->l.len = o->l.head = o->l.alloc = 0;
         o->l.ele = NULL;
+        o->l.tree = NULL;
+        o->l.code = NULL;
         s++;
         /* Parse comma separated elements. */
         while(1) {
@@ -241,7 +855,7 @@ obj *parseObject(aoclactx *ctx, const char *s, const char **next, int *line) {
                 release(o);
                 return NULL;
             } else if (o->type == OBJ_TYPE_TUPLE &&
-                       (element->type != OBJ_TYPE_SYMBOL ||
+                       (OBJ_TYPE(element) != OBJ_TYPE_SYMBOL ||
                         element->str.len != 1))
             {
                 /* Tuples can be only composed of one character symbols. */
@@ -251,7 +865,7 @@ obj *parseObject(aoclactx *ctx, const char *s, const char **next, int *line) {
                     "Tuples can only contain single character symbols");
                 return NULL;
             }
-            o->l.ele = myrealloc(o->l.ele, sizeof(obj*)*(o->l.len+1));
+            listMakeRoom(o,1,LIST_TAIL);
             o->l.ele[o->l.len++] = element;
             s = nextptr; /* Continue from first byte not parsed. */
 
@@ -272,25 +886,14 @@ obj *parseObject(aoclactx *ctx, const char *s, const char **next, int *line) {
         const char *end = s;
         while(issymbol(*end)) end++;
         o->str.len = end-s;
-        char *dest = myalloc(o->str.len+1);
-        o->str.ptr = dest;
-        memcpy(dest,s,o->str.len);
-        dest[o->str.len] = 0;
+        o->str.proc = NULL;
+        o->str.epoch = 0;
+        o->str.ptr = (char*)internSymbol(s,o->str.len);
         if (next) *next = end;
-    } else if (s[0]=='#') {             /* Boolean. */
-        if (s[1] != 't' && s[1] != 'f') {
-            setError(ctx,s,"Booelans are either #t or #f");
-            release(o);
-            return NULL;
-        }
-        o->type = OBJ_TYPE_BOOL;
-        o->istrue = s[1] == 't' ? 1 : 0;
-        s += 2;
-        if (next) *next = s;
     } else if (s[0] == '"') {           /* String. */
         s++; /* Skip " */
         o->type = OBJ_TYPE_STRING;
-        o->str.ptr = myalloc(1); /* We need at least space for nullterm. */
+        o->str.ptr = bufAlloc(1); /* We need at least space for nullterm. */
         o->str.len = 0;
         while(s[0] && s[0] != '"') {
             int c = s[0];
@@ -307,10 +910,10 @@ obj *parseObject(aoclactx *ctx, const char *s, const char **next, int *line) {
             default:
                 break;
             }
-            /* Here we abuse realloc() ability to overallocate for us
+            /* Here we abuse bufRealloc() ability to overallocate for us
              * in order to avoid complexity. We allocate len+2 because we
              * need 1 byte for the current char, 1 for the nullterm. */
-            o->str.ptr = myrealloc(o->str.ptr,o->str.len+2);
+            o->str.ptr = bufRealloc(o->str.ptr,o->str.len+2);
             o->str.ptr[o->str.len++] = c;
             s++;
         }
@@ -335,23 +938,30 @@ obj *parseObject(aoclactx *ctx, const char *s, const char **next, int *line) {
  * -1 if a<b; 0 if a==b; 1 if a>b. */
 #define COMPARE_TYPE_MISMATCH INT_MIN
 int compare(obj *a, obj *b) {
+    int atype = OBJ_TYPE(a), btype = OBJ_TYPE(b);
+
     /* Int VS Int */
-    if (a->type == OBJ_TYPE_INT && b->type == OBJ_TYPE_INT) {
-        if (a->i < b->i) return -1;
-        else if (a->i > b->i) return 1;
+    if (atype == OBJ_TYPE_INT && btype == OBJ_TYPE_INT) {
+        int ai = INT_VALUE(a), bi = INT_VALUE(b);
+        if (ai < bi) return -1;
+        else if (ai > bi) return 1;
         return 0;
     }
 
     /* Bool vs Bool. */
-    if (a->type == OBJ_TYPE_BOOL && b->type == OBJ_TYPE_BOOL) {
-        if (a->istrue < b->istrue) return -1;
-        else if (a->istrue > b->istrue) return 1;
+    if (atype == OBJ_TYPE_BOOL && btype == OBJ_TYPE_BOOL) {
+        if (BOOL_VALUE(a) < BOOL_VALUE(b)) return -1;
+        else if (BOOL_VALUE(a) > BOOL_VALUE(b)) return 1;
         return 0;
     }
 
+    /* Symbol VS Symbol: same interned name, same symbol. */
+    if (atype == OBJ_TYPE_SYMBOL && btype == OBJ_TYPE_SYMBOL &&
+        a->str.ptr == b->str.ptr) return 0;
+
     /* String|Symbol VS String|Symbol. */
-    if ((a->type == OBJ_TYPE_STRING || a->type == OBJ_TYPE_SYMBOL) &&
-        (b->type == OBJ_TYPE_STRING || b->type == OBJ_TYPE_SYMBOL))
+    if ((atype == OBJ_TYPE_STRING || atype == OBJ_TYPE_SYMBOL) &&
+        (btype == OBJ_TYPE_STRING || btype == OBJ_TYPE_SYMBOL))
     {
         int cmp = strcmp(a->str.ptr,b->str.ptr);
         /* Normalize. */
@@ -361,8 +971,8 @@ int compare(obj *a, obj *b) {
     }
 
     /* List|Tuple vs List|Tuple. */
-    if ((a->type == OBJ_TYPE_LIST || a->type == OBJ_TYPE_TUPLE) &&
-        (b->type == OBJ_TYPE_LIST || b->type == OBJ_TYPE_TUPLE))
+    if ((atype == OBJ_TYPE_LIST || atype == OBJ_TYPE_TUPLE) &&
+        (btype == OBJ_TYPE_LIST || btype == OBJ_TYPE_TUPLE))
     {
         /* Len wins. */
         if (a->l.len < b->l.len) return -1;
@@ -388,9 +998,10 @@ void printobj(obj *obj, int flags) {
     const char *escape;
     int color = flags & PRINT_COLOR;
     int repr = flags & PRINT_REPR;
+    int type = OBJ_TYPE(obj);
 
     if (color) {
-        switch(obj->type) {
+        switch(type) {
         case OBJ_TYPE_LIST: escape = "\033[33;1m"; break;       /* Yellow. */
         case OBJ_TYPE_TUPLE: escape = "\033[34;1m"; break;      /* Blue. */
         case OBJ_TYPE_SYMBOL: escape = "\033[36;1m"; break;     /* Cyan. */
@@ -401,9 +1012,9 @@ void printobj(obj *obj, int flags) {
         printf("%s",escape); /* Set color. */
     }
 
-    switch(obj->type) {
+    switch(type) {
     case OBJ_TYPE_INT:
-        printf("%d",obj->i);
+        printf("%d",INT_VALUE(obj));
         break;
     case OBJ_TYPE_SYMBOL:
         printf("%s",obj->str.ptr);
@@ -427,13 +1038,13 @@ void printobj(obj *obj, int flags) {
         }
         break;
     case OBJ_TYPE_BOOL:
-        printf("#%c",obj->istrue ? 't' : 'f');
+        printf("#%c",BOOL_VALUE(obj) ? 't' : 'f');
         break;
     case OBJ_TYPE_LIST:
     case OBJ_TYPE_TUPLE:
         if (repr) printf("%c",obj->type == OBJ_TYPE_LIST ? '[' : '(');
         for (size_t j = 0; j < obj->l.len; j++) {
-            printobj(obj->l.ele[j],flags);
+            printobj(listGet(obj,j),flags);
             if (j != obj->l.len-1) printf(" ");
         }
         if (color) printf("%s",escape); /* Restore upper level color. */
@@ -443,72 +1054,500 @@ void printobj(obj *obj, int flags) {
     if (color) printf("\033[0m"); /* Color off. */
 }
 
-/* Allocate an int object with value 'i'. */
+/* Return an int object with value 'i'. Integers are immediate values
+ * stored inside the pointer itself, unless they don't fit, in which case
+ * an OBJ_TYPE_INT object is allocated. This can only happen if pointers
+ * are not larger than 'int'. */
 obj *newInt(int i) {
-    obj *o = newObject(OBJ_TYPE_INT);
-    o->i = i;
-    return o;
+#if IMMEDIATE_INT_MAX < INT_MAX
+    if (i < IMMEDIATE_INT_MIN || i > IMMEDIATE_INT_MAX) {
+        obj *o = newObject(OBJ_TYPE_INT);
+        o->i = i;
+        return o;
+    }
+#endif
+    return IMMEDIATE_INT(i);
 }
 
-/* Allocate a boolean object with value 'b' (1 true, 0 false). */
+/* Return a boolean object with value 'b' (1 true, 0 false). Booleans
+ * are always immediate values. */
 obj *newBool(int b) {
-    obj *o = newObject(OBJ_TYPE_BOOL);
-    o->istrue = b;
-    return o;
+    return IMMEDIATE_BOOL(b);
 }
 
+/* Single character strings, produced for instance by get@ when scanning
+ * strings, are preallocated immortal objects shared by all interpreters
+ * of the thread, created on first use. Like any other shared object, they get copied
+ * by getUnsharedObject() when modified. */
+_Thread_local obj *SharedCharStrings[256];
+
 /* Allocate a string object initialized with the content at 's' for
  * 'len' bytes. */
 obj *newString(const char *s, size_t len) {
+    if (len == 1) {
+        obj **shared = &SharedCharStrings[(unsigned char)s[0]];
+        if (*shared == NULL) {
+            *shared = newObject(OBJ_TYPE_STRING);
+            (*shared)->refcount = OBJ_REFCOUNT_IMMORTAL;
+            (*shared)->str.len = 1;
+            (*shared)->str.proc = NULL;
+            (*shared)->str.epoch = 0;
+            (*shared)->str.ptr = bufAlloc(2);
+            (*shared)->str.ptr[0] = s[0];
+            (*shared)->str.ptr[1] = 0;
+        }
+        return *shared;
+    }
+
     obj *o = newObject(OBJ_TYPE_STRING);
     o->str.len = len;
-    o->str.ptr = myalloc(len+1);
+    o->str.proc = NULL;
+    o->str.epoch = 0;
+    o->str.ptr = bufAlloc(len+1);
     memcpy(o->str.ptr,s,len);
     o->str.ptr[len] = 0;
     return o;
 }
 
-/* Deep copy the passed object. Return an object with refcount = 1. */
-obj *deepCopy(obj *o) {
+/* Return a new empty list. */
+obj *newList(void) {
+    obj *o = newObject(OBJ_TYPE_LIST);
+    o->l.len = o->l.head = o->l.alloc = 0;
+    o->l.ele = NULL;
+    o->l.tree = NULL;
+    o->l.code = NULL;
+    o->l.quoted = 0;
+    return o;
+}
+
+/* Copy the passed object. Return an object with refcount = 1.
+ *
+ * The copy is shallow: the elements of lists and tuples are not copied,
+ * they are just retained by the new list. Since shared objects are never
+ * modified in place (see getUnsharedObject()), this is enough to make
+ * the copy independent: if later a nested element gets modified, it
+ * will be copied at that time, and only that level. */
+obj *shallowCopy(obj *o) {
     if (o == NULL) return NULL;
+    if (IS_IMMEDIATE(o)) return o;
     obj *c = newObject(o->type);
     switch(o->type) {
     case OBJ_TYPE_INT: c->i = o->i; break;
-    case OBJ_TYPE_BOOL: c->istrue = o->istrue; break;
     case OBJ_TYPE_LIST:
     case OBJ_TYPE_TUPLE:
         c->l.len = o->l.len;
-        c->l.ele = myalloc(sizeof(obj*)*o->l.len);
-        for (size_t j = 0; j < o->l.len; j++)
-            c->l.ele[j] = deepCopy(o->l.ele[j]);
+        c->l.head = 0;
+        c->l.quoted = o->l.quoted;
+        c->l.code = NULL;
+        c->l.tree = o->l.tree;
+        if (o->l.tree) {
+            /* Trees are persistent: just share it. */
+            c->l.tree->refcount++;
+            c->l.ele = NULL;
+            c->l.alloc = 0;
+            break;
+        }
+        c->l.alloc = o->l.len;
+        c->l.ele = bufAlloc(sizeof(obj*)*o->l.len);
+        for (size_t j = 0; j < o->l.len; j++) {
+            c->l.ele[j] = o->l.ele[j];
+            retain(c->l.ele[j]);
+        }
         break;
     case OBJ_TYPE_STRING:
     case OBJ_TYPE_SYMBOL:
         c->str.len = o->str.len;
         c->str.quoted = o->str.quoted; /* Only useful for symbols. */
-        c->str.ptr = myalloc(o->str.len+1);
-        memcpy(c->str.ptr,o->str.ptr,o->str.len+1);
+        c->str.proc = NULL;
+        c->str.epoch = 0;
+        if (o->type == OBJ_TYPE_SYMBOL) {
+            c->str.ptr = o->str.ptr; /* Interned. */
+        } else {
+            c->str.ptr = bufAlloc(o->str.len+1);
+            memcpy(c->str.ptr,o->str.ptr,o->str.len+1);
+        }
         break;
     }
     return c;
 }
 
-/* This function performs a deep copy of the object if it has a refcount > 1.
+/* This function performs a copy of the object if it has a refcount > 1.
  * The copy is returned. Otherwise if refcount is 1, the function returns
  * the same object we passed as argument. This is useful when we want to
  * modify a shared object.
  *
  * When the function returns a copy, the reference count of the original
- * object is decremented, as the object logically lost one reference. */
+ * object is decremented, as the object logically lost one reference.
+ *
+ * Big shared lists are converted to their tree representation before
+ * copying them, so that the copy shares the tree instead of copying the
+ * elements array, and the modification that follows is O(log N).
+ *
+ * Since the caller is going to modify the object, if it is a list that
+ * we return as it is, its compiled form is discarded. Similarly symbols
+ * forget the procedure they resolved to. */
 obj *getUnsharedObject(obj *o) {
     if (o->refcount > 1) {
+        if (o->type == OBJ_TYPE_LIST && o->l.len >= LIST_TREE_MIN_LEN)
+            listToTree(o);
         release(o);
-        return deepCopy(o);
+        return shallowCopy(o);
     } else {
+        if ((o->type & (OBJ_TYPE_LIST|OBJ_TYPE_TUPLE)) && o->l.code) {
+            releaseCode(o->l.code);
+            o->l.code = NULL;
+        } else if (o->type == OBJ_TYPE_SYMBOL) {
+            o->str.proc = NULL;
+            o->str.epoch = 0;
+        }
         return o;
     }
 }
 
+/* =========================== Persistent lists =============================
+ * Lists are normally flat arrays of objects. This is the fastest
+ * representation as long as the list is not shared, but modifying a
+ * shared list requires copying it, that is O(N). So big lists, when they
+ * are shared and need to be modified, are converted into a different
+ * representation: a persistent balanced tree of leaves, each holding up
+ * to VNODE_LEAF_MAX elements, where each inner node stores the number of
+ * elements of its subtree. Trees are never modified in place when shared:
+ * modifications copy just the path from the root to the leaf involved,
+ * and the rest of the tree is shared with the old version. This way
+ * copying a list is O(1), and get@, ->, <-, cat, and slicing are
+ * O(log N), even when the list is shared.
+ *
+ * The tree is kept balanced like an AVL tree: the heights of the two
+ * children of a node never differ by more than one. The join operation,
+ * that concatenates two trees of arbitrary heights in O(log N), is the
+ * building block for everything else.
+ *
+ * Nodes are reference counted like objects. The functions below take
+ * ownership of the references of the nodes passed to them, and return a
+ * new reference.
+ * ========================================================================== */
+
+/* Create a leaf with the 'count' elements at 'ele', that are retained. */
+vnode *vnodeNewLeaf(obj **ele, size_t count) {
+    vnode *n = myalloc(sizeof(vnode)+sizeof(obj*)*VNODE_LEAF_MAX);
+    n->refcount = 1;
+    n->height = 0;
+    n->size = count;
+    n->left = n->right = NULL;
+    for (size_t j = 0; j < count; j++) {
+        n->ele[j] = ele[j];
+        retain(ele[j]);
+    }
+    Allocator.vnodes++;
+    return n;
+}
+
+/* Create an inner node with the two specified children. */
+vnode *vnodeNewInner(vnode *left, vnode *right) {
+    vnode *n = myalloc(sizeof(vnode));
+    n->refcount = 1;
+    n->left = left;
+    n->right = right;
+    n->height = 1+(left->height > right->height ? left->height :
+                                                  right->height);
+    n->size = left->size + right->size;
+    Allocator.vnodes++;
+    return n;
+}
+
+void vnodeRelease(vnode *n) {
+    if (n == NULL || --n->refcount > 0) return;
+    if (n->height == 0) {
+        for (size_t j = 0; j < n->size; j++) release(n->ele[j]);
+    } else {
+        vnodeRelease(n->left);
+        vnodeRelease(n->right);
+    }
+    free(n);
+    Allocator.vnodes--;
+}
+
+/* Return a node we can modify in place: 'n' itself if not shared,
+ * otherwise a copy of it. */
+vnode *vnodeUnshare(vnode *n) {
+    if (n->refcount == 1) return n;
+    vnode *c;
+    if (n->height == 0) {
+        c = vnodeNewLeaf(n->ele,n->size);
+    } else {
+        n->left->refcount++;
+        n->right->refcount++;
+        c = vnodeNewInner(n->left,n->right);
+    }
+    n->refcount--;
+    return c;
+}
+
+/* Consume the inner node 'n' returning its children. */
+void vnodeTakeChildren(vnode *n, vnode **left, vnode **right) {
+    *left = n->left;
+    *right = n->right;
+    if (n->refcount == 1) {
+        free(n);
+        Allocator.vnodes--;
+    } else {
+        n->refcount--;
+        (*left)->refcount++;
+        (*right)->refcount++;
+    }
+}
+
+/* Create a balanced node with the trees 'a' and 'b', whose heights must
+ * not differ by more than two, performing the AVL rotations needed. */
+vnode *vnodeBalance(vnode *a, vnode *b) {
+    vnode *x, *y, *z, *w;
+    if (a->height > b->height+1) {
+        vnodeTakeChildren(a,&x,&y);
+        if (x->height >= y->height)
+            return vnodeNewInner(x,vnodeNewInner(y,b));
+        vnodeTakeChildren(y,&z,&w);
+        return vnodeNewInner(vnodeNewInner(x,z),vnodeNewInner(w,b));
+    } else if (b->height > a->height+1) {
+        vnodeTakeChildren(b,&x,&y);
+        if (y->height >= x->height)
+            return vnodeNewInner(vnodeNewInner(a,x),y);
+        vnodeTakeChildren(x,&z,&w);
+        return vnodeNewInner(vnodeNewInner(a,z),vnodeNewInner(w,y));
+    }
+    return vnodeNewInner(a,b);
+}
+
+/* Called after one of the children of the unshared inner node 'n' was
+ * replaced: update the node, rebalancing it if needed. */
+vnode *vnodeUpdate(vnode *n) {
+    int diff = n->left->height - n->right->height;
+    if (diff >= -1 && diff <= 1) {
+        n->height = 1+(diff > 0 ? n->left->height : n->right->height);
+        n->size = n->left->size + n->right->size;
+        return n;
+    }
+    vnode *left, *right;
+    vnodeTakeChildren(n,&left,&right);
+    return vnodeBalance(left,right);
+}
+
+/* Concatenate the trees 'a' and 'b', any of which can be NULL. */
+vnode *vnodeJoin(vnode *a, vnode *b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+
+    /* Two small leaves: merge them. */
+    if (a->height == 0 && b->height == 0 &&
+        a->size + b->size <= VNODE_LEAF_MAX)
+    {
+        a = vnodeUnshare(a);
+        for (size_t j = 0; j < b->size; j++) {
+            a->ele[a->size++] = b->ele[j];
+            retain(b->ele[j]);
+        }
+        vnodeRelease(b);
+        return a;
+    }
+
+    /* Descend the spine of the taller tree until we find a subtree
+     * with a similar height, then rebalance on the way back. */
+    vnode *left, *right;
+    if (a->height > b->height+1) {
+        vnodeTakeChildren(a,&left,&right);
+        return vnodeBalance(left,vnodeJoin(right,b));
+    } else if (b->height > a->height+1) {
+        vnodeTakeChildren(b,&left,&right);
+        return vnodeBalance(vnodeJoin(a,left),right);
+    }
+    return vnodeNewInner(a,b);
+}
+
+/* Split the tree 'n' into the tree with its first 'idx' elements,
+ * returned in '*a', and the tree with the remaining ones, in '*b'.
+ * Both can be set to NULL if empty. */
+void vnodeSplit(vnode *n, size_t idx, vnode **a, vnode **b) {
+    if (idx == 0) {
+        *a = NULL;
+        *b = n;
+    } else if (idx >= n->size) {
+        *a = n;
+        *b = NULL;
+    } else if (n->height == 0) {
+        *a = vnodeNewLeaf(n->ele,idx);
+        *b = vnodeNewLeaf(n->ele+idx,n->size-idx);
+        vnodeRelease(n);
+    } else {
+        vnode *left, *right, *x, *y;
+        vnodeTakeChildren(n,&left,&right);
+        if (idx < left->size) {
+            vnodeSplit(left,idx,&x,&y);
+            *a = x;
+            *b = vnodeJoin(y,right);
+        } else {
+            vnodeSplit(right,idx-left->size,&x,&y);
+            *a = vnodeJoin(left,x);
+            *b = y;
+        }
+    }
+}
+
+/* Add the object 'o' at the end (where == LIST_TAIL) or at the start
+ * (where == LIST_HEAD) of the tree 'n'. */
+vnode *vnodeAdd(vnode *n, obj *o, int where) {
+    if (n->height == 0) {
+        if (n->size == VNODE_LEAF_MAX) {
+            vnode *leaf = vnodeNewLeaf(&o,1);
+            release(o); /* vnodeNewLeaf() retained it. */
+            return where == LIST_TAIL ? vnodeNewInner(n,leaf) :
+                                        vnodeNewInner(leaf,n);
+        }
+        n = vnodeUnshare(n);
+        if (where == LIST_TAIL) {
+            n->ele[n->size] = o;
+        } else {
+            memmove(n->ele+1,n->ele,sizeof(obj*)*n->size);
+            n->ele[0] = o;
+        }
+        n->size++;
+        return n;
+    }
+    n = vnodeUnshare(n);
+    if (where == LIST_TAIL)
+        n->right = vnodeAdd(n->right,o,where);
+    else
+        n->left = vnodeAdd(n->left,o,where);
+    return vnodeUpdate(n);
+}
+
+/* Build a balanced tree with the 'count' elements at 'ele', that are
+ * retained. */
+vnode *vnodeFromArray(obj **ele, size_t count) {
+    if (count <= VNODE_LEAF_MAX) return vnodeNewLeaf(ele,count);
+    size_t leaves = (count+VNODE_LEAF_MAX-1)/VNODE_LEAF_MAX;
+    size_t half = (leaves/2)*VNODE_LEAF_MAX;
+    return vnodeNewInner(vnodeFromArray(ele,half),
+                         vnodeFromArray(ele+half,count-half));
+}
+
+/* Copy the elements of the tree 'n' into 'dst', retaining them. Return
+ * the number of elements copied. */
+size_t vnodeToArray(vnode *n, obj **dst) {
+    if (n->height == 0) {
+        for (size_t j = 0; j < n->size; j++) {
+            dst[j] = n->ele[j];
+            retain(dst[j]);
+        }
+        return n->size;
+    }
+    size_t count = vnodeToArray(n->left,dst);
+    return count + vnodeToArray(n->right,dst+count);
+}
+
+/* Return the element at index 'idx' of the list (or tuple) 'l', that
+ * must be in range. No reference is added to the returned object. */
+obj *listGet(obj *l, size_t idx) {
+    if (l->l.tree == NULL) return l->l.ele[idx];
+    vnode *n = l->l.tree;
+    while(n->height) {
+        if (idx < n->left->size) {
+            n = n->left;
+        } else {
+            idx -= n->left->size;
+            n = n->right;
+        }
+    }
+    return n->ele[idx];
+}
+
+/* Convert the flat list 'l' into the tree representation. This does not
+ * change the list value, so it is fine to call it on shared lists. */
+void listToTree(obj *l) {
+    if (l->l.tree) return;
+    vnode *tree = vnodeFromArray(l->l.ele,l->l.len);
+    for (size_t j = 0; j < l->l.len; j++) release(l->l.ele[j]);
+    bufFree(l->l.ele ? l->l.ele-l->l.head : NULL);
+    l->l.ele = NULL;
+    l->l.head = l->l.alloc = 0;
+    l->l.tree = tree;
+}
+
+/* Convert the tree list 'l' back into a flat list. */
+void listFlatten(obj *l) {
+    if (l->l.tree == NULL) return;
+    l->l.ele = bufAlloc(sizeof(obj*)*l->l.len);
+    l->l.head = 0;
+    l->l.alloc = l->l.len;
+    vnodeToArray(l->l.tree,l->l.ele);
+    vnodeRelease(l->l.tree);
+    l->l.tree = NULL;
+}
+
+/* Add the object 'o' at the end (where == LIST_TAIL) or at the start
+ * (where == LIST_HEAD) of the unshared list 'l'. The reference of 'o' is
+ * now owned by the list. */
+void listAdd(obj *l, obj *o, int where) {
+    if (l->l.tree) {
+        l->l.tree = vnodeAdd(l->l.tree,o,where);
+    } else if (where == LIST_TAIL) {
+        listMakeRoom(l,1,LIST_TAIL);
+        l->l.ele[l->l.len] = o;
+    } else {
+        listMakeRoom(l,1,LIST_HEAD);
+        l->l.ele--;
+        l->l.head--;
+        l->l.ele[0] = o;
+    }
+    l->l.len++;
+}
+
+/* Append all the elements of 'src' to the unshared list 'dst'. If any of
+ * the two lists is a tree, the result is a tree, and the operation
+ * is O(log N). */
+void listCat(obj *dst, obj *src) {
+    if (dst->l.tree || src->l.tree) {
+        listToTree(dst);
+        listToTree(src); /* Fine even if shared, the value is the same. */
+        src->l.tree->refcount++;
+        dst->l.tree = vnodeJoin(dst->l.tree,src->l.tree);
+    } else {
+        listMakeRoom(dst,src->l.len,LIST_TAIL);
+        for (size_t j = 0; j < src->l.len; j++) {
+            dst->l.ele[dst->l.len+j] = src->l.ele[j];
+            retain(src->l.ele[j]);
+        }
+    }
+    dst->l.len += src->l.len;
+}
+
+/* Retain only the 'count' elements starting at 'start' of the unshared
+ * list 'l'. The range must be valid. For flat lists, removing elements
+ * at the start just moves the elements pointer into the head room, so
+ * dropping the first element of a list is O(1). */
+void listSlice(obj *l, size_t start, size_t count) {
+    if (l->l.tree) {
+        vnode *a, *b, *c;
+        vnodeSplit(l->l.tree,start,&a,&b);
+        vnodeRelease(a);
+        if (b) {
+            vnodeSplit(b,count,&b,&c);
+            vnodeRelease(c);
+        }
+        if (b == NULL) b = vnodeNewLeaf(NULL,0);
+        l->l.tree = b;
+        l->l.len = count;
+        /* Tree lists are always big lists: the many code paths that
+         * only handle small lists can assume l->l.ele is valid. */
+        if (count < LIST_TREE_MIN_LEN) listFlatten(l);
+    } else {
+        for (size_t j = 0; j < start; j++) release(l->l.ele[j]);
+        for (size_t j = start+count; j < l->l.len; j++)
+            release(l->l.ele[j]);
+        l->l.ele += start;
+        l->l.head += start;
+    }
+    l->l.len = count;
+}
+
 /* ========================== Interpreter state ============================= */
 
 /* Set the syntax or runtime error, if the context is not NULL. */
@@ -529,37 +1568,112 @@ void setError(aoclactx *ctx, const char *ptr, const char *msg) {
     }
 }
 
-/* Create a new stack frame. */
-stackframe *newStackFrame(aoclactx *ctx) {
-    stackframe *sf = myalloc(sizeof(*sf));
-    memset(sf->locals,0,sizeof(sf->locals));
+/* Create a new stack frame, taking it from the pool if possible.
+ * 'sizehint' is the number of vars the frame is expected to bind. */
+stackframe *newStackFrame(aoclactx *ctx, int sizehint) {
+    stackframe *sf = ctx->freeframes;
+    if (sf) {
+        ctx->freeframes = sf->prev;
+    } else {
+        sf = myalloc(sizeof(*sf));
+        sf->vars = NULL;
+        sf->allocvars = 0;
+    }
+    sf->numvars = 0;
+    sf->sizehint = sizehint;
     sf->curproc = NULL;
-    sf->prev = ctx ? ctx->frame : NULL;
+    sf->prev = ctx->frame;
     return sf;
 }
 
-/* Free a stack frame. */
-void freeStackFrame(stackframe *sf) {
-    for (int j = 0; j < AOCLA_NUMVARS; j++) release(sf->locals[j]);
-    free(sf);
+/* Release the vars of a stack frame, so that it can be used for
+ * another procedure binding about 'sizehint' vars. */
+void clearStackFrame(stackframe *sf, int sizehint) {
+    for (int j = 0; j < sf->numvars; j++) release(sf->vars[j].val);
+    sf->numvars = 0;
+    sf->sizehint = sizehint;
+}
+
+/* Release the vars of a stack frame and put it back into the pool. */
+void freeStackFrame(aoclactx *ctx, stackframe *sf) {
+    clearStackFrame(sf,0);
+    sf->prev = ctx->freeframes;
+    ctx->freeframes = sf;
+}
+
+/* Return the value of the local var 'name', or NULL if unbound. */
+obj *getLocal(stackframe *sf, int name) {
+    for (int j = 0; j < sf->numvars; j++)
+        if (sf->vars[j].name == name) return sf->vars[j].val;
+    return NULL;
+}
+
+/* Bind the local var 'name' to 'val', that is now owned by the frame. */
+void setLocal(stackframe *sf, int name, obj *val) {
+    for (int j = 0; j < sf->numvars; j++) {
+        if (sf->vars[j].name == name) {
+            release(sf->vars[j].val);
+            sf->vars[j].val = val;
+            return;
+        }
+    }
+    if (sf->numvars == sf->allocvars) {
+        int size = sf->allocvars ? sf->allocvars*2 : 4;
+        if (size < sf->sizehint) size = sf->sizehint;
+        sf->vars = myrealloc(sf->vars,sizeof(localvar)*size);
+        sf->allocvars = size;
+    }
+    sf->vars[sf->numvars].name = name;
+    sf->vars[sf->numvars].val = val;
+    sf->numvars++;
 }
 
 aoclactx *newInterpreter(void) {
     aoclactx *i = myalloc(sizeof(*i));
     i->stacklen = 0;
-    i->stack = NULL; /* Will be allocated on push of new elements. */
-    i->proc = NULL; /* That's a linked list. Starts empty. */
-    i->frame = newStackFrame(NULL);
+    i->stackalloc = AOCLA_STACK_INITIAL_SIZE;
+    i->stack = myalloc(sizeof(obj*) * i->stackalloc);
+    procTableInit(&i->proc[0],PROCTABLE_INITIAL_SIZE);
+    i->proc[1].table = NULL;
+    i->proc[1].size = i->proc[1].used = 0;
+    i->rehashidx = -1;
+    i->epoch = 1;
+    i->frame = NULL;
+    i->freeframes = NULL;
+    i->cont = NULL;
+    i->contlen = i->contalloc = 0;
+    i->maxdepth = AOCLA_MAX_DEPTH;
+    i->jump = NULL;
+    i->frame = newStackFrame(i,0);
     loadLibrary(i);
     return i;
 }
 
-/* Push an object on the interpreter stack. No refcount change. */
+/* Push an object on the interpreter stack. No refcount change.
+ * When the stack is full its allocation is doubled, so that pushing
+ * is amortized O(1). */
 void stackPush(aoclactx *ctx, obj *o) {
-    ctx->stack = myrealloc(ctx->stack,sizeof(obj*) * (ctx->stacklen+1));
+    if (ctx->stacklen == ctx->stackalloc) {
+        ctx->stackalloc *= 2;
+        ctx->stack = myrealloc(ctx->stack,sizeof(obj*) * ctx->stackalloc);
+    }
     ctx->stack[ctx->stacklen++] = o;
 }
 
+/* Give back to the system the memory used by the stack after a spike:
+ * the allocation is halved as long as less than 1/4 of it is in use, but
+ * never below AOCLA_STACK_INITIAL_SIZE. The hysteresis between growing
+ * and shrinking avoids reallocating continuously around a given size.
+ * This is called when an evaluation ends, see eval(). */
+void stackShrink(aoclactx *ctx) {
+    size_t newalloc = ctx->stackalloc;
+    while(newalloc > AOCLA_STACK_INITIAL_SIZE && ctx->stacklen < newalloc/4)
+        newalloc /= 2;
+    if (newalloc == ctx->stackalloc) return;
+    ctx->stackalloc = newalloc;
+    ctx->stack = myrealloc(ctx->stack,sizeof(obj*) * ctx->stackalloc);
+}
+
 /* Pop an object from the stack without modifying its refcount.
  * Return NULL if stack is empty. */
 obj *stackPop(aoclactx *ctx) {
@@ -595,119 +1709,2328 @@ void stackShow(aoclactx *ctx) {
     if (ctx->stacklen) printf("\n");
 }
 
-/* ================================ Eval ==================================== */
-
-/* Evaluate the program in the list 'l' in the specified context 'ctx'.
- * Expects a list object. Evaluation uses the following rules:
+/* =========================== Static analysis ==============================
+ * Before execution, lists are analyzed by interpreting them abstractly:
+ * instead of values, we track the types of the values pushed on the
+ * stack and stored in local vars, as far as they can be known, and the
+ * stack depth relative to the start of the list. Builtins are known via
+ * their signatures, and the code passed to if, ifelse, while, eval and
+ * upeval as literal lists is analyzed recursively. Calling any other
+ * procedure may do anything to the stack and to our local vars, so
+ * after such a call the analysis starts again knowing nothing.
  *
- * 1. List elements are scanned from left to right.
- * 2. If an element is a symbol, a function bound to such symbol is
- *    searched and executed. If no function is found with such a name
- *    an error is raised.
- * 3. If an element is a tuple, the stack elements are captured into the
- *    local variables with the same names as the tuple elements. If we
- *    run out of stack, an error is raised.
- * 4. Any other object type is just pushed on the stack.
+ * The literal lists passed to if, ifelse, while, eval, map and foreach
+ * run in our frame, so they are compiled together with the list, knowing
+ * the types our local vars have when they start, see specializeControl().
  *
- * Return 1 on runtime erorr. Otherwise 0 is returned.
- */
-int eval(aoclactx *ctx, obj *l) {
-    assert (l->type == OBJ_TYPE_LIST);
+ * The result is used in two ways:
+ *
+ * 1. Calls to builtins whose arguments are proved to be of the right
+ *    type are marked, so that the VM skips the arguments check.
+ * 2. When a procedure is defined, code that changes the stack depth
+ *    depending on the branch taken, or loops whose body changes the
+ *    stack depth at every iteration, are reported as warnings.
+ * ========================================================================== */
 
-    for (size_t j = 0; j < l->l.len; j++) {
-        obj *o = l->l.ele[j];
-        aproc *proc;
-        ctx->frame->curline = o->line;
+#define ANALYSIS_STACK_LEN 16   /* Max number of stack types tracked. */
+#define ANALYSIS_ANY 0xff       /* Unknown type: all the type bits set. */
 
-        switch(o->type) {
-        case OBJ_TYPE_TUPLE:                /* Capture variables. */
-            /* Quoted tuples just get pushed on the stack, losing
-             * their quoted status. */
-            if (o->l.quoted) {
-                obj *notq = deepCopy(o);
-                notq->l.quoted = 0;
-                stackPush(ctx,notq);
-                break;
-            }
+typedef struct astate {
+    int type[ANALYSIS_STACK_LEN];   /* Types of the top 'len' stack values,
+                                       the last one is the top. */
+    obj *lit[ANALYSIS_STACK_LEN];   /* Literal list pushed, or NULL. */
+    int len;
+    int depth, mindepth;    /* Stack depth relative to the start. */
+    int unknown;            /* True if the depth could not be tracked. */
+    int local[256];         /* Types of local vars, 0 if unknown. */
+    const char *proc;       /* Procedure name to report warnings, or
+                               NULL not to report them. */
+    aoclactx *ctx;          /* If not NULL, the list analyzed, 'l', is
+                               being compiled into 'ins'. */
+    obj *l;
+    instr *ins;
+} astate;
 
-            if (ctx->stacklen < o->l.len) {
-                setError(ctx,o->l.ele[ctx->stacklen]->str.ptr,
-                    "Out of stack while capturing local");
-                return 1;
-            }
+/* Stack effect of a list: values consumed from the stack and values
+ * left in their place. 'known' is false if it could not be determined. */
+typedef struct effect {
+    int in, out, known;
+} effect;
 
-            /* Bind each variable to the corresponding locals array,
-             * removing it from the stack. */
-            ctx->stacklen -= o->l.len;
-            for (size_t i = 0; i < o->l.len; i++) {
-                int idx = o->l.ele[i]->str.ptr[0];
-                release(ctx->frame->locals[idx]);
-                ctx->frame->locals[idx] =
-                    ctx->stack[ctx->stacklen+i];
-            }
-            break;
-        case OBJ_TYPE_SYMBOL:
-            /* Quoted symbols don't generate a procedure call, but like
-             * any other object they get pushed on the stack. */
-            if (o->str.quoted) {
-                obj *notq = deepCopy(o);
-                notq->str.quoted = 0;
-                stackPush(ctx,notq);
-                break;
-            }
+/* Search the builtin with the specified name in the Builtins table. */
+const builtin *findBuiltin(const char *name) {
+    for (const builtin *b = Builtins; b->name; b++)
+        if (!strcmp(b->name,name)) return b;
+    return NULL;
+}
 
-            /* Not quoted symbols get looked up and executed if they
-             * don't start with "$". Otherwise are handled as locals
-             * push on the stack. */
-            if (o->str.ptr[0] == '$') {     /* Push local var. */
-                int idx = o->str.ptr[1];
-                if (ctx->frame->locals[idx] == NULL) {
-                    setError(ctx,o->str.ptr, "Unbound local var");
-                    return 1;
-                }
-                stackPush(ctx,ctx->frame->locals[idx]);
-                retain(ctx->frame->locals[idx]);
-            } else {                        /* Call procedure. */
-                proc = lookupProc(ctx,o->str.ptr);
-                if (proc == NULL) {
-                    setError(ctx,o->str.ptr,
-                        "Symbol not bound to procedure");
-                    return 1;
-                }
-                if (proc->cproc) {
-                    /* Call a procedure implemented in C. */
-                    aproc *prev = ctx->frame->curproc;
-                    ctx->frame->curproc = proc;
-                    int err = proc->cproc(ctx);
-                    ctx->frame->curproc = prev;
-                    if (err) return err;
+void astatePop(astate *s, int count) {
+    s->len = s->len > count ? s->len-count : 0;
+    s->depth -= count;
+    if (s->depth < s->mindepth) s->mindepth = s->depth;
+}
+
+void astatePush(astate *s, int type, obj *lit) {
+    if (s->len == ANALYSIS_STACK_LEN) {
+        memmove(s->type,s->type+1,sizeof(int)*(ANALYSIS_STACK_LEN-1));
+        memmove(s->lit,s->lit+1,sizeof(obj*)*(ANALYSIS_STACK_LEN-1));
+        s->len--;
+    }
+    s->type[s->len] = type & ANALYSIS_ANY;
+    s->lit[s->len] = lit;
+    s->len++;
+    s->depth++;
+}
+
+/* Called after running code we know nothing about. */
+void astateForget(astate *s) {
+    s->len = 0;
+    s->unknown = 1;
+    memset(s->local,0,sizeof(s->local));
+}
+
+/* Apply the stack effect 'e' of some code executed in the current
+ * frame: since the code may capture local vars, we forget them. */
+void astateApply(astate *s, effect e) {
+    if (!e.known) {
+        astateForget(s);
+        return;
+    }
+    astatePop(s,e.in);
+    for (int j = 0; j < e.out; j++) astatePush(s,ANALYSIS_ANY,NULL);
+    memset(s->local,0,sizeof(s->local));
+}
+
+void analysisWarning(astate *s, int line, const char *msg, const char *op) {
+    if (s->proc == NULL) return;
+    fprintf(stderr,"Warning: %s %s in %s:%d\n", op, msg, s->proc, line);
+}
+
+effect analyzeList(aoclactx *ctx, obj *l, instr *ins, const char *proc,
+                   int *locals);
+
+/* Merge the local var types 'src' into 'dst', returning true if 'dst'
+ * changed. A var is known only if it is known in both. */
+int localsJoin(int *dst, const int *src) {
+    int changed = 0;
+    for (int j = 0; j < 256; j++) {
+        int type = (dst[j] && src[j]) ? dst[j] | src[j] : 0;
+        if (type != dst[j]) changed = 1;
+        dst[j] = type;
+    }
+    return changed;
+}
+
+/* Compile the literal list at index 'j' of the list being compiled as a
+ * private copy, knowing that when it starts the local vars have the
+ * types 'locals'. The copy replaces the original in the instruction
+ * pushing it: no other code can run it. */
+void specializeList(astate *s, size_t j, const int *locals) {
+    obj *copy = shallowCopy(s->ins[j].o);
+    copy->line = s->ins[j].o->line;
+    copy->l.code = compileList(s->ctx,copy,locals);
+    release(s->ins[j].o);
+    s->ins[j].o = copy;
+}
+
+/* The call to the control builtin 'b' at index 'j' of the list being
+ * compiled executes in our frame the literal lists just before it:
+ * compile them with the types of the local vars when they start. For
+ * while, map and foreach the code may run many times, so the types are
+ * the ones known both before the loop and after any iteration. */
+#define SPECIALIZE_MAX_PASSES 8
+void specializeControl(astate *s, const builtin *b, size_t j) {
+    int looping = !strcmp(b->name,"while") || !strcmp(b->name,"map") ||
+                  !strcmp(b->name,"foreach");
+    int first = looping && strcmp(b->name,"while"); /* Skip the seq. */
+    obj *args[3];
+    if (s->ctx == NULL || !strcmp(b->name,"upeval") ||
+        s->len < b->argc || j < (size_t)b->argc) return;
+    for (int i = first; i < b->argc; i++) {
+        size_t idx = j-b->argc+i;
+        args[i] = s->lit[s->len-b->argc+i];
+        if (args[i] == NULL || listGet(s->l,idx) != args[i] ||
+            s->ins[idx].op != OP_PUSH) return;
+    }
+
+    /* Types at the start of the first list, and after it. */
+    int start[256], after[256], end[256];
+    memcpy(start,s->local,sizeof(start));
+    for (int pass = 0; ; pass++) {
+        if (pass == SPECIALIZE_MAX_PASSES) return;
+        memcpy(after,start,sizeof(after));
+        analyzeList(NULL,args[first],NULL,NULL,after);
+        if (!looping) break;
+        memcpy(end,after,sizeof(end));
+        if (b->argc-first == 2) analyzeList(NULL,args[1],NULL,NULL,end);
+        if (!localsJoin(start,end)) break;
+    }
+
+    specializeList(s,j-b->argc+first,start);
+    for (int i = first+1; i < b->argc; i++)
+        specializeList(s,j-b->argc+i,after);
+}
+
+/* Analyze the call to the control builtin 'b' (if, ifelse, while, eval,
+ * upeval), that is only possible if the code it executes was pushed as
+ * literal lists. */
+void analyzeControl(astate *s, const builtin *b, int line) {
+    if (s->len < b->argc) {
+        astateForget(s);
+        return;
+    }
+    obj **args = s->lit+s->len-b->argc;
+    effect e[3];
+    for (int j = 0; j < b->argc; j++) {
+        if (args[j] == NULL) {
+            astateForget(s);
+            return;
+        }
+        e[j] = analyzeList(NULL,args[j],NULL,s->proc,NULL);
+    }
+    astatePop(s,b->argc);
+
+    if (b->argc == 1) {                     /* eval, upeval. */
+        astateApply(s,e[0]);
+        return;
+    }
+
+    /* The condition, that must leave a boolean on the stack. */
+    astateApply(s,e[0]);
+    if (e[0].known && e[0].out-e[0].in != 1)
+        analysisWarning(s,line,"condition should push a single value",
+                        b->name);
+    astatePop(s,1);
+
+    effect body = e[1];
+    if (b->argc == 3) {                     /* ifelse. */
+        if (e[1].known && e[2].known &&
+            e[1].out-e[1].in != e[2].out-e[2].in)
+        {
+            analysisWarning(s,line,"branches have different stack effects",
+                            b->name);
+            body.known = 0;
+        } else if (e[2].known && e[2].in > body.in) {
+            body.out += e[2].in-body.in;
+            body.in = e[2].in;
+        }
+        body.known = body.known && e[2].known;
+    } else if (body.known && body.out != body.in) {
+        analysisWarning(s,line,!strcmp(b->name,"if") ?
+            "branch changes the stack depth" :
+            "body changes the stack depth at every iteration", b->name);
+        body.known = 0;
+    }
+    astateApply(s,body);
+}
+
+/* Analyze the list 'l' returning its stack effect. If 'ins' is not NULL
+ * it is the compiled code of the list, and the 'checked' field of calls
+ * to builtins is set when the arguments are proved to be valid: if 'ctx'
+ * is not NULL too, the literal lists passed to control builtins are
+ * compiled, see specializeControl(). If 'proc' is not NULL, warnings are
+ * reported as part of such procedure. If 'locals' is not NULL, it has
+ * the types of the local vars when the list starts, and is updated with
+ * their types at its end. */
+effect analyzeList(aoclactx *ctx, obj *l, instr *ins, const char *proc,
+                   int *locals)
+{
+    astate s;
+    memset(&s,0,sizeof(s));
+    s.proc = proc;
+    s.ctx = ins ? ctx : NULL;
+    s.l = l;
+    s.ins = ins;
+    if (locals) memcpy(s.local,locals,sizeof(s.local));
+
+    int line = l->line;
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        if (!IS_IMMEDIATE(o)) line = o->line;
+        if (ins) ins[j].checked = NULL;
+
+        switch(OBJ_TYPE(o)) {
+        case OBJ_TYPE_TUPLE:
+            if (o->l.quoted) {
+                astatePush(&s,OBJ_TYPE_TUPLE,NULL);
+                break;
+            }
+            /* Capture: the captured vars take the types of the values. */
+            for (size_t i = 0; i < o->l.len; i++) {
+                int idx = s.len-(int)o->l.len+(int)i;
+                unsigned char var = o->l.ele[i]->str.ptr[0];
+                s.local[var] = idx >= 0 ? s.type[idx] : ANALYSIS_ANY;
+            }
+            astatePop(&s,o->l.len);
+            break;
+        case OBJ_TYPE_SYMBOL:
+            if (o->str.quoted) {
+                astatePush(&s,OBJ_TYPE_SYMBOL,NULL);
+            } else if (o->str.ptr[0] == '$') {
+                int type = s.local[(unsigned char)o->str.ptr[1]];
+                astatePush(&s,type ? type : ANALYSIS_ANY,NULL);
+            } else {
+                const builtin *b = BuiltinsRedefined ? NULL :
+                                   findBuiltin(o->str.ptr);
+                if (b == NULL) {
+                    astateForget(&s);
+                    break;
+                }
+                /* Are the arguments proved to be valid? */
+                int valid = s.len >= b->argc;
+                for (int i = 0; valid && i < b->argc; i++) {
+                    int type = s.type[s.len-b->argc+i];
+                    if (type & ~BUILTIN_ARGTYPE(b,i)) valid = 0;
+                }
+                if (ins && valid) ins[j].checked = b;
+
+                if (b->retc == BUILTIN_ANY_RET) {
+                    specializeControl(&s,b,j);
+                    if (!strcmp(b->name,"map") ||
+                        !strcmp(b->name,"foreach"))
+                    {
+                        astateForget(&s);
+                    } else {
+                        analyzeControl(&s,b,line);
+                    }
+                } else if (!strcmp(b->name,"dup") && s.len) {
+                    astatePush(&s,s.type[s.len-1],s.lit[s.len-1]);
+                } else if (!strcmp(b->name,"swap") && s.len >= 2) {
+                    astatePop(&s,2);
+                    s.len += 2;
+                    s.depth += 2;
+                    int t = s.type[s.len-1];
+                    obj *lit = s.lit[s.len-1];
+                    s.type[s.len-1] = s.type[s.len-2];
+                    s.lit[s.len-1] = s.lit[s.len-2];
+                    s.type[s.len-2] = t;
+                    s.lit[s.len-2] = lit;
                 } else {
-                    /* Call a procedure implemented in Aocla. */
-                    stackframe *oldsf = ctx->frame;
-                    ctx->frame = newStackFrame(ctx);
-                    ctx->frame->curproc = proc;
-                    int err = eval(ctx,proc->proc);
-                    freeStackFrame(ctx->frame);
-                    ctx->frame = oldsf;
-                    if (err) return err;
+                    astatePop(&s,b->argc);
+                    for (int i = 0; i < b->retc; i++)
+                        astatePush(&s,b->rettype,NULL);
+                }
+            }
+            break;
+        default:
+            astatePush(&s,OBJ_TYPE(o),OBJ_TYPE(o) == OBJ_TYPE_LIST ? o : NULL);
+            break;
+        }
+    }
+
+    if (locals) memcpy(locals,s.local,sizeof(s.local));
+    effect e;
+    e.known = !s.unknown;
+    e.in = -s.mindepth;
+    e.out = s.depth-s.mindepth;
+    return e;
+}
+
+/* ============================== Compiler ==================================
+ * Aocla programs are lists, and lists are compiled into a linear array of
+ * instructions before execution. Compilation is trivial, as each list
+ * element maps exactly to one instruction, but it moves all the decoding
+ * work out of the execution loop.
+ * ========================================================================== */
+
+#ifdef AOCLA_COMPUTED_GOTO
+_Thread_local void **VMLabels = NULL; /* Opcode -> VM label, set by
+                                       vmExec() in each thread. */
+#endif
+
+/* Mark in 'seen' the vars captured by the tuples inside the list 'l',
+ * including the nested lists, and return the number of new vars. */
+int countListVars(obj *l, unsigned char *seen) {
+    int count = 0;
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        if (OBJ_TYPE(o) == OBJ_TYPE_LIST) {
+            count += countListVars(o,seen);
+        } else if (OBJ_TYPE(o) == OBJ_TYPE_TUPLE && !o->l.quoted) {
+            for (size_t i = 0; i < o->l.len; i++) {
+                unsigned char name = o->l.ele[i]->str.ptr[0];
+                if (seen[name]) continue;
+                seen[name] = 1;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/* Return true if the list 'l', or any list nested inside it, may run
+ * code that is not one of its literal lists: code run by upeval, eval,
+ * map and foreach, or by if, ifelse and while when their arguments are
+ * not literal lists. Such code may use upeval to access the frame of our
+ * caller, so a procedure with this body can't reuse the frame of the
+ * procedure calling it. */
+int listRunsCode(obj *l) {
+    static const char *names[] = {"upeval","eval","map","foreach",NULL};
+    size_t literals = 0; /* Literal lists just before the current one. */
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        if (OBJ_TYPE(o) == OBJ_TYPE_LIST) {
+            if (listRunsCode(o)) return 1;
+            literals++;
+            continue;
+        }
+        if (OBJ_TYPE(o) == OBJ_TYPE_SYMBOL && !o->str.quoted) {
+            for (int i = 0; names[i]; i++)
+                if (!strcmp(o->str.ptr,names[i])) return 1;
+            if ((!strcmp(o->str.ptr,"if") && literals < 2) ||
+                (!strcmp(o->str.ptr,"ifelse") && literals < 3) ||
+                (!strcmp(o->str.ptr,"while") && literals < 2)) return 1;
+        }
+        literals = 0;
+    }
+    return 0;
+}
+
+/* If the instruction 'ins' calls one of the procedures in 'names', a
+ * space separated list, return the operator code to store in the 'var'
+ * field of the instruction: the first char of the name, or the second
+ * one for two chars operators, where "<=" and ">=" map to 'l' and 'g'.
+ * Otherwise zero is returned. */
+int callOperator(instr *ins, const char *names) {
+    if (ins->op != OP_CALL) return 0;
+    const char *name = ins->o->str.ptr;
+    size_t len = strlen(name);
+    if (len == 0 || len > 2) return 0;
+    const char *p = strstr(names,name);
+    if (p == NULL || (p[len] != ' ' && p[len] != 0) ||
+        (p != names && p[-1] != ' ')) return 0;
+    if (len == 1) return name[0];
+    if (name[0] == '<') return 'l';
+    if (name[0] == '>') return 'g';
+    return name[0];
+}
+
+/* Peephole pass fusing the most common sequences of instructions into
+ * superinstructions. Only the opcode of the first instruction of the
+ * sequence is changed: the other instructions are left as they are, so
+ * when the fast path can't be taken (a local is not set or has the wrong
+ * type, the operator was redefined, ...) the VM can just run the original
+ * sequence starting from the first instruction.
+ *
+ * The sequences handled were selected looking at the output of an
+ * AOCLA_SEQ_STATS build running typical programs:
+ *
+ *  $x 1 + (x)      LOCAL_MATH_SET (same for - and *)
+ *  $x 1 +          LOCAL_MATH
+ *  $x $y <         LOCAL_CMP (also with an int instead of $y, and for
+ *                  all the comparison operators)
+ *  $l $i get@      LOCAL_GET
+ *  $x $y           LOCAL2 */
+void optimizeCode(code *c) {
+    instr *ins = c->ins;
+    size_t j = 0;
+    while (j+1 < c->len) {
+        instr *i = ins+j;
+        if (i->op != OP_LOCAL) {
+            j++;
+            continue;
+        }
+        int intarg = i[1].op == OP_PUSH &&
+                     OBJ_TYPE(i[1].o) == OBJ_TYPE_INT;
+        int localarg = i[1].op == OP_LOCAL;
+        int op = 0;
+        if (intarg && (op = callOperator(i+2,"+ - *"))) {
+            i[2].var = op;
+            obj *t = i[3].o;
+            if (i[3].op == OP_CAPTURE && t->l.len == 1 &&
+                (unsigned char)t->l.ele[0]->str.ptr[0] == i->var)
+            {
+                i->op = OP_LOCAL_MATH_SET;
+                j += 4;
+            } else {
+                i->op = OP_LOCAL_MATH;
+                j += 3;
+            }
+        } else if ((intarg || localarg) &&
+                   (op = callOperator(i+2,"< <= > >= == !=")))
+        {
+            i[2].var = op;
+            i->op = OP_LOCAL_CMP;
+            j += 3;
+        } else if (localarg && i[2].op == OP_CALL &&
+                   !strcmp(i[2].o->str.ptr,"get@"))
+        {
+            i->op = OP_LOCAL_GET;
+            j += 3;
+        } else if (localarg) {
+            i->op = OP_LOCAL2;
+            j += 2;
+        } else {
+            j++;
+        }
+    }
+}
+
+/* Apply the pure builtin 'b' to the constant arguments 'argv', returning
+ * the result as a new object, or NULL if it can't be computed at compile
+ * time because of the types of the arguments, or because it would fail
+ * at runtime: in this case it is up to the VM to report the error. */
+obj *foldBuiltin(const builtin *b, obj **argv) {
+    int atype = OBJ_TYPE(argv[0]);
+    int btype = b->argc == 2 ? OBJ_TYPE(argv[1]) : 0;
+
+    if (b->op && strchr("+-*/",b->op)) {
+        if (atype != OBJ_TYPE_INT || btype != OBJ_TYPE_INT) return NULL;
+        int ai = INT_VALUE(argv[0]), bi = INT_VALUE(argv[1]);
+        switch(b->op) {
+        case '+': return newInt(ai + bi);
+        case '-': return newInt(ai - bi);
+        case '*': return newInt(ai * bi);
+        case '/': return bi ? newInt(ai / bi) : NULL;
+        }
+    } else if (b->op) {
+        int cmp = compare(argv[0],argv[1]);
+        if (cmp == COMPARE_TYPE_MISMATCH) return NULL;
+        switch(b->op) {
+        case '=': return newBool(cmp == 0);
+        case '!': return newBool(cmp != 0);
+        case '>': return newBool(cmp > 0);
+        case 'g': return newBool(cmp >= 0);
+        case '<': return newBool(cmp < 0);
+        case 'l': return newBool(cmp <= 0);
+        }
+    } else if (!strcmp(b->name,"cat")) {
+        if (atype != OBJ_TYPE_STRING || btype != OBJ_TYPE_STRING) return NULL;
+        obj *o = newString(argv[0]->str.ptr,argv[0]->str.len);
+        o->str.ptr = bufRealloc(o->str.ptr,o->str.len+argv[1]->str.len+1);
+        memcpy(o->str.ptr+o->str.len,argv[1]->str.ptr,argv[1]->str.len+1);
+        o->str.len += argv[1]->str.len;
+        return o;
+    } else if (!strcmp(b->name,"len")) {
+        if (atype != OBJ_TYPE_STRING) return NULL;
+        return newInt(argv[0]->str.len);
+    }
+    return NULL;
+}
+
+/* Return true if the builtin 'b' has no side effects, so that it can be
+ * applied at compile time by foldBuiltin(). */
+int isPureBuiltin(const builtin *b) {
+    return b->op || !strcmp(b->name,"cat") || !strcmp(b->name,"len");
+}
+
+/* Constant folding. We track the constant values the code pushes on the
+ * stack: int, bool and string literals, local vars captured from
+ * constants, and the results of pure builtins applied to constants, that
+ * we compute here. Every time a builtin is folded, the first instruction
+ * of the sequence computing its result is turned into OP_CONST.
+ *
+ * Since the values are computed assuming the builtins semantics, OP_CONST
+ * turns back into the original instruction if any builtin is redefined,
+ * and the sequence gets executed normally. Calling any other procedure
+ * may set our local vars (see upeval), so after it we forget the
+ * constant locals. We also don't track values across captures, so that
+ * a folded sequence is never skipped past a capture.
+ *
+ * The folded instructions keep their line numbers, and folding never
+ * hides a runtime error, since foldBuiltin() refuses to fold anything
+ * that would fail. */
+#define FOLD_STACK_LEN 16
+void foldConstants(code *c) {
+    obj *val[FOLD_STACK_LEN];   /* Constants on top of the stack. */
+    size_t start[FOLD_STACK_LEN]; /* Instruction that started computing
+                                     each constant. */
+    int n = 0;
+    obj *local[256] = {0};      /* Constant locals, or NULL. */
+
+    if (BuiltinsRedefined) return;
+    for (size_t j = 0; j < c->len; j++) {
+        instr *ins = c->ins+j;
+        obj *o = ins->o;
+        obj *k = NULL;          /* Constant pushed by this instruction. */
+        const builtin *b;
+
+        switch(ins->op) {
+        case OP_PUSH:
+            if (OBJ_TYPE(o) & (OBJ_TYPE_INT|OBJ_TYPE_BOOL|OBJ_TYPE_STRING))
+                k = o;
+            break;
+        case OP_LOCAL:
+            k = local[ins->var];
+            break;
+        case OP_CAPTURE:
+            for (size_t i = 0; i < o->l.len; i++) {
+                int idx = n-(int)o->l.len+(int)i;
+                local[(unsigned char)o->l.ele[i]->str.ptr[0]] =
+                    idx >= 0 ? val[idx] : NULL;
+            }
+            n = 0;
+            continue;
+        case OP_CALL:
+            b = findBuiltin(o->str.ptr);
+            if (b == NULL || !isPureBuiltin(b)) {
+                memset(local,0,sizeof(local));
+                break;
+            }
+            if (n < b->argc || (k = foldBuiltin(b,val+n-b->argc)) == NULL)
+                break;
+
+            /* Turn the first instruction of the sequence into OP_CONST,
+             * replacing the shorter sequence folded there, if any. */
+            n -= b->argc;
+            instr *first = c->ins+start[n];
+            if (first->aux) release(first->aux);
+            first->op = OP_CONST;
+            first->var = j-start[n]+1;
+            first->aux = k;
+            val[n++] = k;
+            continue;
+        }
+
+        /* Track the constant pushed, or forget everything if we don't
+         * know the value pushed. */
+        if (k == NULL) {
+            n = 0;
+            continue;
+        }
+        if (n == FOLD_STACK_LEN) {
+            memmove(val,val+1,sizeof(obj*)*(FOLD_STACK_LEN-1));
+            memmove(start,start+1,sizeof(size_t)*(FOLD_STACK_LEN-1));
+            n--;
+        }
+        val[n] = k;
+        start[n] = j;
+        n++;
+    }
+}
+
+/* Return true if the list 'l' is the body of a procedure that can be
+ * inlined. To keep the semantics of calling the procedure in a new
+ * frame, it must be small, access only local vars it captured before,
+ * and call only builtins that don't execute code: otherwise the code
+ * executed could access the frame with upeval and eval. No nested list
+ * is allowed for the same reason. */
+#define INLINE_MAX_LEN 16
+int isInlinable(aoclactx *ctx, obj *l) {
+    unsigned char captured[128] = {0};
+    if (l->l.len > INLINE_MAX_LEN) return 0;
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        aproc *proc;
+
+        switch(OBJ_TYPE(o)) {
+        case OBJ_TYPE_LIST:
+            return 0;
+        case OBJ_TYPE_TUPLE:
+            if (o->l.quoted) break;
+            for (size_t i = 0; i < o->l.len; i++) {
+                unsigned char var = listGet(o,i)->str.ptr[0];
+                if (var >= 128) return 0;
+                captured[var] = 1;
+            }
+            break;
+        case OBJ_TYPE_SYMBOL:
+            if (o->str.quoted) break;
+            if (o->str.ptr[0] == '$') {
+                unsigned char var = o->str.ptr[1];
+                if (var >= 128 || !captured[var]) return 0;
+                break;
+            }
+            proc = lookupProcSymbol(ctx,o->str.ptr);
+            if (proc == NULL || proc->builtin == NULL ||
+                proc->builtin->retc == BUILTIN_ANY_RET) return 0;
+            break;
+        }
+    }
+    return 1;
+}
+
+/* Inline the calls to small procedures in the code 'c' of a list using
+ * the local vars marked in 'seen'. The procedure code is copied at the
+ * end of 'c', renaming its local vars setting the most significant bit
+ * of their names, so that they don't clash with the vars of the caller:
+ * for this reason we give up if the caller already uses such names.
+ * The renamed vars are marked in 'seen' and counted in c->numvars.
+ * The instructions copied take the line number of the call, so errors
+ * are reported as happening in the caller.
+ *
+ * The call is turned into OP_INLINE, that jumps to the copy only if the
+ * procedure, and the builtins it calls, were not redefined meanwhile.
+ * Otherwise OP_INLINE turns back into a normal call, and the code is
+ * marked as stale, so that next time getListCode() will compile it
+ * again. */
+void inlineCalls(aoclactx *ctx, code *c, unsigned char *seen) {
+    /* Once builtins are redefined, the inlined code calling them could
+     * end executing Aocla code in the caller frame. */
+    if (BuiltinsRedefined) return;
+    for (int v = 128; v < 256; v++) if (seen[v]) return;
+    size_t mainlen = c->len;
+    for (size_t j = 0; j < mainlen; j++) {
+        if (c->ins[j].op != OP_CALL) continue;
+        aproc *proc = lookupProcSymbol(ctx,c->ins[j].o->str.ptr);
+        if (proc == NULL || proc->proc == NULL ||
+            !isInlinable(ctx,proc->proc)) continue;
+
+        /* Copy the procedure code, but the final OP_RETURN, replaced by
+         * OP_JUMP. Note that compiling the procedure can't inline
+         * anything, since it only calls builtins. */
+        code *pc = getListCode(ctx,proc->proc);
+        size_t start = c->len;
+        c->len += pc->len;
+        c->ins = myrealloc(c->ins,sizeof(instr)*c->len);
+        unsigned char pseen[256] = {0};
+        countListVars(proc->proc,pseen);
+        for (int v = 0; v < 128; v++) {
+            if (!pseen[v] || seen[v|128]) continue;
+            seen[v|128] = 1;
+            c->numvars++;
+        }
+        for (size_t i = 0; i < pc->len-1; i++) {
+            instr *ins = c->ins+start+i;
+            *ins = pc->ins[i];
+            ins->line = c->ins[j].line;
+            if (ins->o) retain(ins->o);
+            if (ins->aux) retain(ins->aux);
+            if (ins->op == OP_CONST && OBJ_TYPE(ins->o) == OBJ_TYPE_SYMBOL) {
+                /* Its fallback would not know about the renaming. */
+                release(ins->aux);
+                ins->aux = NULL;
+                ins->op = OP_LOCAL;
+                ins->var = (unsigned char)ins->o->str.ptr[1];
+            }
+            if (ins->op == OP_CAPTURE) ins->var = 128;
+            if (ins->op == OP_LOCAL || ins->op == OP_LOCAL2 ||
+                ins->op == OP_LOCAL_MATH || ins->op == OP_LOCAL_MATH_SET ||
+                ins->op == OP_LOCAL_CMP || ins->op == OP_LOCAL_GET)
+                ins->var |= 128;
+        }
+        instr *jump = c->ins+c->len-1;
+        memset(jump,0,sizeof(*jump));
+        jump->op = OP_JUMP;
+        jump->line = c->ins[j].line;
+        jump->var = j+1;
+
+        c->ins[j].op = OP_INLINE;
+        c->ins[j].var = start;
+        c->ins[j].aux = proc->proc;
+        retain(proc->proc);
+    }
+}
+
+/* Compile the list 'l' into a new code object with refcount 1. If
+ * 'locals' is not NULL, it has the types the local vars have when the
+ * code starts, see analyzeList(). */
+code *compileList(aoclactx *ctx, obj *l, const int *locals) {
+    int types[256] = {0};
+    assert(l->type == OBJ_TYPE_LIST);
+    unsigned char seen[256] = {0};
+    code *c = myalloc(sizeof(*c));
+    c->refcount = 1;
+    c->stale = 0;
+#ifdef AOCLA_JIT
+    c->hotness = 0;
+    c->trace = NULL;
+#endif
+#ifdef AOCLA_BASELINE_JIT
+    c->calls = 0;
+    c->native = NULL;
+#endif
+    c->len = l->l.len+1;
+    c->ins = myalloc(sizeof(instr)*c->len);
+    c->numvars = countListVars(l,seen);
+    c->runscode = listRunsCode(l);
+
+    int line = l->line;
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        instr *ins = c->ins+j;
+        /* Immediate values have no line number: just retain the line
+         * of the previous element. */
+        if (!IS_IMMEDIATE(o)) line = o->line;
+        ins->line = line;
+        ins->var = 0;
+        ins->o = o;
+        ins->aux = NULL;
+
+        switch(OBJ_TYPE(o)) {
+        case OBJ_TYPE_TUPLE:
+            if (o->l.quoted) {
+                /* Quoted tuples just get pushed on the stack, losing
+                 * their quoted status: we can create the unquoted
+                 * version once for all here. */
+                ins->op = OP_PUSH;
+                ins->o = shallowCopy(o);
+                ins->o->l.quoted = 0;
+            } else {
+                ins->op = OP_CAPTURE;
+                retain(o);
+            }
+            break;
+        case OBJ_TYPE_SYMBOL:
+            if (o->str.quoted) {
+                /* Same as above for quoted symbols. */
+                ins->op = OP_PUSH;
+                ins->o = shallowCopy(o);
+                ins->o->str.quoted = 0;
+            } else if (o->str.ptr[0] == '$') {
+                ins->op = OP_LOCAL;
+                ins->var = (unsigned char)o->str.ptr[1];
+                retain(o);
+            } else {
+                ins->op = OP_CALL;
+                retain(o);
+            }
+            break;
+        default:
+            ins->op = OP_PUSH;
+            retain(o);
+            break;
+        }
+    }
+    c->ins[l->l.len].op = OP_RETURN;
+    c->ins[l->l.len].line = 0;
+    c->ins[l->l.len].var = 0;
+    c->ins[l->l.len].o = NULL;
+    c->ins[l->l.len].checked = NULL;
+    c->ins[l->l.len].aux = NULL;
+    if (locals) memcpy(types,locals,sizeof(types));
+    analyzeList(ctx,l,c->ins,NULL,types);
+#ifndef AOCLA_SEQ_STATS
+    foldConstants(c);
+    optimizeCode(c);
+    inlineCalls(ctx,c,seen);
+#else
+    NOTUSED(ctx);
+#endif
+
+#ifdef AOCLA_COMPUTED_GOTO
+    /* Thread the code, resolving the opcodes into the addresses of the VM
+     * labels. vmExec() called with NULL code initializes VMLabels. */
+    if (VMLabels == NULL) vmExec(NULL,NULL);
+    for (size_t j = 0; j < c->len; j++)
+        c->ins[j].label = VMLabels[c->ins[j].op];
+#endif
+    return c;
+}
+
+/* Return the compiled form of the list 'l', compiling it if needed.
+ * Code where inlined procedures were redefined is compiled again. */
+code *getListCode(aoclactx *ctx, obj *l) {
+    if (l->l.code && l->l.code->stale) {
+        releaseCode(l->l.code);
+        l->l.code = NULL;
+    }
+    if (l->l.code == NULL) l->l.code = compileList(ctx,l,NULL);
+    return l->l.code;
+}
+
+void retainCode(code *c) {
+    c->refcount++;
+}
+
+/* Release the code object, freeing it when no longer referenced. */
+void releaseCode(code *c) {
+    if (--c->refcount > 0) return;
+    for (size_t j = 0; j < c->len; j++) {
+        release(c->ins[j].o);
+        if (c->ins[j].aux) release(c->ins[j].aux);
+    }
+#ifdef AOCLA_JIT
+    if (c->trace) releaseTrace(c->trace);
+#endif
+#ifdef AOCLA_BASELINE_JIT
+    if (c->native) releaseNative(c->native);
+#endif
+    free(c->ins);
+    free(c);
+}
+
+/* ================================ Eval ==================================== */
+
+/* Push a new continuation of the given type on the continuations stack
+ * and return it, or return NULL setting an error if the max depth was
+ * reached. The returned pointer is only valid until the next push. */
+cont *contPush(aoclactx *ctx, int type) {
+    if (ctx->contlen == ctx->maxdepth) {
+        setError(ctx,NULL,"Max call depth reached");
+        return NULL;
+    }
+    if (ctx->contlen == ctx->contalloc) {
+        ctx->contalloc = ctx->contalloc ? ctx->contalloc*2 : 64;
+        ctx->cont = myrealloc(ctx->cont,sizeof(cont)*ctx->contalloc);
+    }
+    cont *k = ctx->cont+ctx->contlen++;
+    k->type = type;
+    k->c = NULL;
+    k->ip = NULL;
+    k->frame = NULL;
+    k->curproc = NULL;
+    k->resume = NULL;
+    k->a = k->b = k->r = NULL;
+    k->idx = 0;
+    return k;
+}
+
+/* Pop the top continuation, releasing the objects it references. The
+ * code, if any, is not released: its reference belongs to the caller. */
+void contPop(aoclactx *ctx) {
+    cont *k = ctx->cont+(--ctx->contlen);
+    release(k->a);
+    release(k->b);
+    release(k->r);
+}
+
+/* On errors, discard all the continuations above 'base', restoring the
+ * stack frames as they were. */
+void contUnwind(aoclactx *ctx, size_t base) {
+    while(ctx->contlen > base) {
+        cont *k = ctx->cont+ctx->contlen-1;
+        if (k->type == CONT_PROC) freeStackFrame(ctx,ctx->frame);
+        if (k->frame) ctx->frame = k->frame;
+        if (k->type == CONT_CODE) ctx->frame->curproc = k->curproc;
+        if (k->c) releaseCode(k->c);
+        contPop(ctx);
+    }
+}
+
+/* Return the procedure the symbol 'sym' is bound to, or NULL. The
+ * procedure is cached inside the symbol, and the cache is used as long as
+ * no procedure was redefined since. */
+aproc *resolveProc(aoclactx *ctx, obj *sym) {
+    if (sym->str.epoch == ctx->epoch) return sym->str.proc;
+    aproc *proc = lookupProcSymbol(ctx,sym->str.ptr);
+    if (proc) {
+        sym->str.proc = proc;
+        sym->str.epoch = ctx->epoch;
+    }
+    return proc;
+}
+
+/* Called by procedures implemented in C to ask the VM to execute the
+ * code 'c' in the current frame, once the procedure returns. The
+ * continuations pushed by the procedure are resumed after the code
+ * returns. */
+void vmJump(aoclactx *ctx, code *c) {
+    retainCode(c);
+    ctx->jump = c;
+#ifdef AOCLA_BASELINE_JIT
+    countExecution(ctx,c);
+#endif
+}
+
+#ifdef AOCLA_SEQ_STATS
+/* When compiled with AOCLA_SEQ_STATS the VM counts how many times each
+ * sequence of 2, 3 and 4 instructions is executed, and the most frequent
+ * ones are reported on exit. This is used to select the sequences worth
+ * fusing into superinstructions, so optimizeCode() and the quickening
+ * of calls are disabled in this mode. Sequences are rendered in a
+ * canonical form, where local vars are renamed in order of appearance
+ * and literals are replaced by their type, so that "$i 1 +" and
+ * "$n 2 +" are counted as the same sequence "$a <int> +". */
+#define SEQ_STATS_TABLE_SIZE 65536
+#define SEQ_STATS_SHOW 30
+typedef struct seqstat {
+    char *seq;
+    unsigned long count;
+} seqstat;
+
+seqstat *SeqStats = NULL;   /* Open addressing table of sequences. */
+size_t SeqStatsUsed = 0;
+
+/* Append to 'buf' the canonical form of the instruction 'ins'. 'names'
+ * maps local var names to their canonical name, names[256] is the
+ * number of distinct vars seen so far. */
+void seqStatsRender(instr *ins, char *buf, size_t len, char *names) {
+    char tmp[64];
+    obj *o = ins->o;
+    int var;
+
+    switch(ins->op) {
+    case OP_PUSH:
+        snprintf(tmp,sizeof(tmp),"<%s>",
+            OBJ_TYPE(o) == OBJ_TYPE_INT ? "int" :
+            OBJ_TYPE(o) == OBJ_TYPE_LIST ? "list" :
+            OBJ_TYPE(o) == OBJ_TYPE_BOOL ? "bool" : "obj");
+        break;
+    case OP_LOCAL:
+    case OP_CAPTURE:
+        if (ins->op == OP_CAPTURE && o->l.len != 1) {
+            snprintf(tmp,sizeof(tmp),"(%zu vars)",o->l.len);
+            break;
+        }
+        var = ins->op == OP_LOCAL ? ins->var :
+                                    (unsigned char)o->l.ele[0]->str.ptr[0];
+        if (names[var] == 0) names[var] = 'a' + names[256]++;
+        snprintf(tmp,sizeof(tmp),ins->op == OP_LOCAL ? "$%c" : "(%c)",
+            names[var]);
+        break;
+    default:
+        snprintf(tmp,sizeof(tmp),"%.60s",o->str.ptr);
+        break;
+    }
+    if (buf[0]) strncat(buf," ",len-strlen(buf)-1);
+    strncat(buf,tmp,len-strlen(buf)-1);
+}
+
+/* Sort by count, most frequent first. */
+int seqStatsCompare(const void *a, const void *b) {
+    const seqstat *sa = a, *sb = b;
+    if (sa->count == sb->count) return 0;
+    return sa->count < sb->count ? 1 : -1;
+}
+
+/* Report the most frequent sequences on standard error. Called at exit. */
+void seqStatsDump(void) {
+    qsort(SeqStats,SEQ_STATS_TABLE_SIZE,sizeof(seqstat),seqStatsCompare);
+    fprintf(stderr,"--- Most executed instruction sequences ---\n");
+    for (int j = 0; j < SEQ_STATS_SHOW && SeqStats[j].count; j++)
+        fprintf(stderr,"%12lu  %s\n", SeqStats[j].count, SeqStats[j].seq);
+}
+
+/* Count the sequences starting at the instruction 'ip'. */
+void seqStatsRecord(instr *ip) {
+    if (SeqStats == NULL) {
+        SeqStats = myalloc(sizeof(seqstat)*SEQ_STATS_TABLE_SIZE);
+        memset(SeqStats,0,sizeof(seqstat)*SEQ_STATS_TABLE_SIZE);
+        atexit(seqStatsDump);
+    }
+
+    char buf[512] = {0};
+    char names[257] = {0}; /* Var -> canonical name, then the number
+                              of distinct vars seen so far. */
+    for (int j = 0; j < 4 && ip[j].op != OP_RETURN; j++) {
+        seqStatsRender(ip+j,buf,sizeof(buf),names);
+        if (j == 0) continue;
+
+        /* The table is never rehashed: once it is almost full, new
+         * sequences are just not counted. */
+        uint32_t h = 5381;
+        for (char *p = buf; *p; p++) h = h*33 + (unsigned char)*p;
+        size_t idx = h & (SEQ_STATS_TABLE_SIZE-1);
+        while(SeqStats[idx].seq && strcmp(SeqStats[idx].seq,buf))
+            idx = (idx+1) & (SEQ_STATS_TABLE_SIZE-1);
+        if (SeqStats[idx].seq == NULL) {
+            if (SeqStatsUsed >= SEQ_STATS_TABLE_SIZE/2) continue;
+            SeqStats[idx].seq = myalloc(strlen(buf)+1);
+            memcpy(SeqStats[idx].seq,buf,strlen(buf)+1);
+            SeqStatsUsed++;
+        }
+        SeqStats[idx].count++;
+    }
+}
+#define VM_SEQ_STATS() seqStatsRecord(ip)
+#else
+#define VM_SEQ_STATS()
+#endif
+
+/* Execute the compiled code 'c' in the specified context 'ctx'.
+ * Instructions are executed from first to last:
+ *
+ * 1. OP_CALL searches the procedure bound to the symbol and executes it.
+ *    If no function is found with such a name an error is raised. The
+ *    procedure found is cached inside the symbol object.
+ * 2. OP_CAPTURE captures the stack elements into the local variables with
+ *    the same names as the tuple elements. If we run out of stack, an
+ *    error is raised.
+ * 3. OP_LOCAL pushes the value of a local variable on the stack.
+ * 4. OP_PUSH just pushes the object on the stack.
+ *
+ * Calling an Aocla procedure does not recurse: we push a CONT_PROC
+ * continuation with the caller frame and the instruction to resume,
+ * and switch to the procedure code. When we reach OP_RETURN, we resume
+ * the top continuation. Continuations for code with nothing left to
+ * execute are never pushed, so calls in tail position don't consume
+ * space. Moreover, when such a call is the last thing the procedure
+ * owning the current frame does (the top continuation is its
+ * CONT_PROC), the frame is reused for the called procedure. Procedures
+ * that may run code using upeval are excluded, since they need the frame
+ * of the caller to still exist, see listRunsCode().
+ *
+ * Since vmExec() may be called again by C code while it is already
+ * running, it only resumes the continuations it pushed, above 'base'.
+ *
+ * Return 1 on runtime erorr. Otherwise 0 is returned.
+ */
+#ifdef AOCLA_COMPUTED_GOTO
+/* Labels as values are an extension: don't warn with -pedantic. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define VM_SWITCH(op)
+#define VM_CASE(op) label_##op: VM_SEQ_STATS();
+#define VM_DISPATCH() goto *ip->label
+#else
+#define VM_SWITCH(op) switch(op)
+#define VM_CASE(op) case op: VM_SEQ_STATS();
+#define VM_DISPATCH() goto dispatch
+#endif
+#define VM_NEXT() do { ip++; VM_DISPATCH(); } while(0)
+#ifdef AOCLA_COMPUTED_GOTO
+#define VM_REWRITE(i,opcode) do { \
+    (i)->op = (opcode); (i)->label = VMLabels[(opcode)]; } while(0)
+#else
+#define VM_REWRITE(i,opcode) do { (i)->op = (opcode); } while(0)
+#endif
+
+int vmExec(aoclactx *ctx, code *c) {
+#ifdef AOCLA_COMPUTED_GOTO
+    static void *labels[OP_COUNT] = {&&label_OP_PUSH, &&label_OP_LOCAL,
+        &&label_OP_CAPTURE, &&label_OP_CALL, &&label_OP_RETURN,
+        &&label_OP_LOCAL2, &&label_OP_LOCAL_MATH, &&label_OP_LOCAL_MATH_SET,
+        &&label_OP_LOCAL_CMP, &&label_OP_LOCAL_GET, &&label_OP_CALL_INT_MATH,
+        &&label_OP_CALL_INT_CMP, &&label_OP_CALL_STR_CMP, &&label_OP_CONST,
+        &&label_OP_INLINE, &&label_OP_JUMP,
+#ifdef AOCLA_BASELINE_JIT
+        &&label_OP_NATIVE
+#endif
+    };
+    if (c == NULL) {
+        VMLabels = labels;
+        return 0;
+    }
+#endif
+    size_t base = ctx->contlen;
+    instr *ip = c->ins;
+    obj *o, *b;
+    int ai, bi;
+    aproc *proc;
+    code *pc;
+    cont *k;
+    instr *deopted = NULL; /* Last quickened instruction turned back. */
+
+    /* The code is retained during the execution, since the list it
+     * belongs to may be released meanwhile, for instance if a procedure
+     * redefines itself. */
+    retainCode(c);
+#ifdef AOCLA_COMPUTED_GOTO
+    VM_DISPATCH();
+#else
+dispatch:
+#endif
+    VM_SWITCH(ip->op) {
+        VM_CASE(OP_RETURN)
+            /* Resume the top continuation. Continuations that have no
+             * code to execute are popped, until we find some code or no
+             * continuation is left. */
+            releaseCode(c);
+            c = NULL;
+            while(c == NULL && ctx->contlen > base) {
+                k = ctx->cont+ctx->contlen-1;
+                if (k->type == CONT_CPROC) {
+                    if (k->resume(ctx,k)) goto rterr;
+                    c = ctx->jump;
+                    ctx->jump = NULL;
+                    if (c) ip = c->ins;
+                    continue;
+                }
+                if (k->type == CONT_PROC) {
+                    freeStackFrame(ctx,ctx->frame);
+                    ctx->frame = k->frame;
+                    if (ctx->stackalloc > AOCLA_STACK_INITIAL_SIZE &&
+                        ctx->stacklen < ctx->stackalloc/4) stackShrink(ctx);
+                } else {
+                    ctx->frame->curproc = k->curproc;
+                }
+                c = k->c;
+                ip = k->ip;
+                ctx->contlen--;
+            }
+            if (c == NULL) return 0;
+            VM_DISPATCH();
+        VM_CASE(OP_PUSH)
+            stackPush(ctx,ip->o);
+            retain(ip->o);
+            VM_NEXT();
+        VM_CASE(OP_LOCAL)
+op_local:   /* Superinstructions jump here to run the sequence normally. */
+            /* The current line is only needed for error reporting and
+             * by the procedures we call, so we don't set it for every
+             * instruction. */
+            ctx->frame->curline = ip->line;
+            o = getLocal(ctx->frame,ip->var);
+            if (o == NULL) {
+                setError(ctx,ip->o->str.ptr, "Unbound local var");
+                goto rterr;
+            }
+            stackPush(ctx,o);
+            retain(o);
+            VM_NEXT();
+        VM_CASE(OP_CAPTURE)
+            ctx->frame->curline = ip->line;
+            o = ip->o;
+            if (ctx->stacklen < o->l.len) {
+                setError(ctx,o->l.ele[ctx->stacklen]->str.ptr,
+                    "Out of stack while capturing local");
+                goto rterr;
+            }
+
+            /* Bind each variable to the corresponding stack value,
+             * removing it from the stack. In inlined code 'var' renames
+             * the vars, see inlineCalls(). */
+            ctx->stacklen -= o->l.len;
+            for (size_t i = 0; i < o->l.len; i++)
+                setLocal(ctx->frame,
+                         (unsigned char)o->l.ele[i]->str.ptr[0] | ip->var,
+                         ctx->stack[ctx->stacklen+i]);
+            VM_NEXT();
+        VM_CASE(OP_CALL)
+op_call:    ctx->frame->curline = ip->line;
+            proc = resolveProc(ctx,ip->o);
+            if (proc == NULL) {
+                setError(ctx,ip->o->str.ptr,"Symbol not bound to procedure");
+                goto rterr;
+            }
+
+#ifndef AOCLA_SEQ_STATS
+            /* Quicken calls to arithmetic and comparison operators if
+             * the operands have one of the types we specialize for. */
+            if (ip != deopted && builtinOp(proc) && ctx->stacklen >= 2) {
+                int math = strchr("+-*/",builtinOp(proc)) != NULL;
+                int atype = OBJ_TYPE(stackPeek(ctx,1));
+                int btype = OBJ_TYPE(stackPeek(ctx,0));
+                int op = OP_CALL;
+                if (atype == OBJ_TYPE_INT && btype == OBJ_TYPE_INT) {
+                    op = math ? OP_CALL_INT_MATH : OP_CALL_INT_CMP;
+                } else if (atype == OBJ_TYPE_STRING &&
+                           btype == OBJ_TYPE_STRING && !math)
+                {
+                    op = OP_CALL_STR_CMP;
+                }
+                if (op != OP_CALL) {
+                    ip->var = builtinOp(proc);
+                    VM_REWRITE(ip,op);
+                    VM_DISPATCH();
+                }
+            }
+#endif
+
+            if (proc->cproc) {
+                /* Call a procedure implemented in C. */
+                aproc *prev = ctx->frame->curproc;
+                size_t mark = ctx->contlen;
+                ctx->frame->curproc = proc;
+                if ((proc->builtin &&
+                     (ip->checked != proc->builtin || BuiltinsRedefined) &&
+                     checkBuiltinArgs(ctx,proc->builtin)) ||
+                    proc->cproc(ctx))
+                {
+                    ctx->frame->curproc = prev;
+                    goto rterr;
+                }
+                if (ctx->jump == NULL) {
+                    ctx->frame->curproc = prev;
+                    VM_NEXT();
+                }
+
+                /* The procedure asked to execute some code. Unless
+                 * nothing is left to execute here, we need to resume
+                 * the current code later: insert its continuation
+                 * below the ones the procedure pushed. */
+                if (ip[1].op != OP_RETURN) {
+                    if (contPush(ctx,CONT_CODE) == NULL) goto rterr;
+                    memmove(ctx->cont+mark+1,ctx->cont+mark,
+                            sizeof(cont)*(ctx->contlen-mark-1));
+                    k = ctx->cont+mark;
+                    k->type = CONT_CODE;
+                    k->c = c;
+                    k->ip = ip+1;
+                    k->frame = NULL;
+                    k->curproc = prev;
+                    k->resume = NULL;
+                    k->a = k->b = k->r = NULL;
+                } else {
+                    releaseCode(c);
+                }
+                c = ctx->jump;
+                ctx->jump = NULL;
+                ip = c->ins;
+                VM_DISPATCH();
+            }
+
+            /* Call a procedure implemented in Aocla. */
+            pc = getListCode(ctx,proc->proc);
+            retainCode(pc);
+#ifdef AOCLA_BASELINE_JIT
+            countExecution(ctx,pc);
+#endif
+            if (ip[1].op == OP_RETURN && !pc->runscode &&
+                ctx->contlen > base &&
+                ctx->cont[ctx->contlen-1].type == CONT_PROC)
+            {
+                /* Tail call: reuse the current frame. */
+                clearStackFrame(ctx->frame,pc->numvars);
+            } else {
+                k = contPush(ctx,CONT_PROC);
+                if (k == NULL) {
+                    releaseCode(pc);
+                    goto rterr;
+                }
+                k->frame = ctx->frame;
+                if (ip[1].op != OP_RETURN) {
+                    k->c = c;
+                    k->ip = ip+1;
+                    c = NULL;
+                }
+                ctx->frame = newStackFrame(ctx,pc->numvars);
+            }
+            ctx->frame->curproc = proc;
+            if (c) releaseCode(c);
+            c = pc;
+            ip = c->ins;
+            VM_DISPATCH();
+
+        /* Superinstructions, see optimizeCode(). */
+        VM_CASE(OP_LOCAL2)
+            o = getLocal(ctx->frame,ip->var);
+            b = getLocal(ctx->frame,ip[1].var);
+            if (o == NULL || b == NULL) goto op_local;
+            stackPush(ctx,o);
+            stackPush(ctx,b);
+            retain(o);
+            retain(b);
+            ip += 2;
+            VM_DISPATCH();
+        VM_CASE(OP_LOCAL_MATH)
+        VM_CASE(OP_LOCAL_MATH_SET)
+            o = getLocal(ctx->frame,ip->var);
+            if (o == NULL || OBJ_TYPE(o) != OBJ_TYPE_INT) goto op_local;
+            proc = resolveProc(ctx,ip[2].o);
+            if (builtinOp(proc) != ip[2].var) goto op_local;
+            ai = INT_VALUE(o);
+            bi = INT_VALUE(ip[1].o);
+            switch(ip[2].var) {
+            case '+': ai = ai + bi; break;
+            case '-': ai = ai - bi; break;
+            case '*': ai = ai * bi; break;
+            }
+            if (ip->op == OP_LOCAL_MATH) {
+                stackPush(ctx,newInt(ai));
+                ip += 3;
+            } else {
+                setLocal(ctx->frame,ip->var,newInt(ai));
+                ip += 4;
+            }
+            VM_DISPATCH();
+        VM_CASE(OP_LOCAL_CMP)
+            o = getLocal(ctx->frame,ip->var);
+            b = ip[1].op == OP_LOCAL ? getLocal(ctx->frame,ip[1].var) :
+                                       ip[1].o;
+            if (o == NULL || b == NULL || OBJ_TYPE(o) != OBJ_TYPE_INT ||
+                OBJ_TYPE(b) != OBJ_TYPE_INT) goto op_local;
+            proc = resolveProc(ctx,ip[2].o);
+            if (builtinOp(proc) != ip[2].var) goto op_local;
+            ai = INT_VALUE(o);
+            bi = INT_VALUE(b);
+            switch(ip[2].var) {
+            case '<': ai = ai < bi; break;
+            case 'l': ai = ai <= bi; break;
+            case '>': ai = ai > bi; break;
+            case 'g': ai = ai >= bi; break;
+            case '=': ai = ai == bi; break;
+            case '!': ai = ai != bi; break;
+            }
+            stackPush(ctx,newBool(ai));
+            ip += 3;
+            VM_DISPATCH();
+        VM_CASE(OP_LOCAL_GET)
+            o = getLocal(ctx->frame,ip->var);
+            b = getLocal(ctx->frame,ip[1].var);
+            if (o == NULL || b == NULL || OBJ_TYPE(b) != OBJ_TYPE_INT ||
+                !(OBJ_TYPE(o) & (OBJ_TYPE_LIST|OBJ_TYPE_TUPLE)))
+                goto op_local;
+            proc = resolveProc(ctx,ip[2].o);
+            if (proc == NULL || proc->cproc != procListGetAt) goto op_local;
+            ai = INT_VALUE(b);
+            if (ai < 0) ai += o->l.len;
+            if (ai < 0 || (size_t)ai >= o->l.len) goto op_local;
+            o = listGet(o,ai);
+            stackPush(ctx,o);
+            retain(o);
+            ip += 3;
+            VM_DISPATCH();
+
+        VM_CASE(OP_CONST)
+            if (BuiltinsRedefined) {
+                /* The value was computed assuming the builtins semantics:
+                 * turn back into the original instruction, that was a
+                 * local var access or the push of a literal. */
+                if (OBJ_TYPE(ip->o) == OBJ_TYPE_SYMBOL) {
+                    ip->var = (unsigned char)ip->o->str.ptr[1];
+                    VM_REWRITE(ip,OP_LOCAL);
+                } else {
+                    VM_REWRITE(ip,OP_PUSH);
+                }
+                VM_DISPATCH();
+            }
+            stackPush(ctx,ip->aux);
+            retain(ip->aux);
+            ip += ip->var;
+            VM_DISPATCH();
+
+        VM_CASE(OP_INLINE)
+            proc = resolveProc(ctx,ip->o);
+            if (proc == NULL || proc->proc != ip->aux || BuiltinsRedefined) {
+                VM_REWRITE(ip,OP_CALL);
+                c->stale = 1;
+                goto op_call;
+            }
+            ip = c->ins+ip->var;
+            VM_DISPATCH();
+        VM_CASE(OP_JUMP)
+            ip = c->ins+ip->var;
+            VM_DISPATCH();
+
+        /* Quickened calls, see OP_CALL. */
+        VM_CASE(OP_CALL_INT_MATH)
+            o = stackPeek(ctx,1);
+            b = stackPeek(ctx,0);
+            if (o == NULL || OBJ_TYPE(o) != OBJ_TYPE_INT ||
+                OBJ_TYPE(b) != OBJ_TYPE_INT) goto deopt;
+            proc = resolveProc(ctx,ip->o);
+            if (builtinOp(proc) != ip->var) goto deopt;
+            ai = INT_VALUE(o);
+            bi = INT_VALUE(b);
+            switch(ip->var) {
+            case '+': ai = ai + bi; break;
+            case '-': ai = ai - bi; break;
+            case '*': ai = ai * bi; break;
+            case '/':
+                if (bi == 0) goto deopt;
+                ai = ai / bi;
+                break;
+            }
+            ctx->stacklen -= 2;
+            release(o);
+            release(b);
+            stackPush(ctx,newInt(ai));
+            VM_NEXT();
+        VM_CASE(OP_CALL_INT_CMP)
+        VM_CASE(OP_CALL_STR_CMP)
+            o = stackPeek(ctx,1);
+            b = stackPeek(ctx,0);
+            if (o == NULL) goto deopt;
+            if (ip->op == OP_CALL_INT_CMP) {
+                if (OBJ_TYPE(o) != OBJ_TYPE_INT ||
+                    OBJ_TYPE(b) != OBJ_TYPE_INT) goto deopt;
+                ai = INT_VALUE(o);
+                bi = INT_VALUE(b);
+            } else {
+                if (OBJ_TYPE(o) != OBJ_TYPE_STRING ||
+                    OBJ_TYPE(b) != OBJ_TYPE_STRING) goto deopt;
+                ai = strcmp(o->str.ptr,b->str.ptr);
+                bi = 0;
+            }
+            proc = resolveProc(ctx,ip->o);
+            if (builtinOp(proc) != ip->var) goto deopt;
+            switch(ip->var) {
+            case '<': ai = ai < bi; break;
+            case 'l': ai = ai <= bi; break;
+            case '>': ai = ai > bi; break;
+            case 'g': ai = ai >= bi; break;
+            case '=': ai = ai == bi; break;
+            case '!': ai = ai != bi; break;
+            }
+            ctx->stacklen -= 2;
+            release(o);
+            release(b);
+            stackPush(ctx,newBool(ai));
+            VM_NEXT();
+deopt:
+            /* The quickened instruction no longer applies: turn it back
+             * into a generic call, that may quicken it again later, but
+             * not right now, or a division by zero would loop forever. */
+            VM_REWRITE(ip,OP_CALL);
+            deopted = ip;
+            NOTUSED(deopted); /* Only read when quickening is enabled. */
+            goto op_call;
+
+#ifdef AOCLA_BASELINE_JIT
+        VM_CASE(OP_NATIVE)
+            /* Run the native code from this instruction, up to the first
+             * one the VM should execute, that is dispatched by opcode,
+             * since its label may be the one of OP_NATIVE itself. */
+            ip = runNative(ctx,c,ip);
+            if (ip == NULL) goto rterr;
+            goto *labels[ip->op];
+#endif
+    }
+
+rterr:  /* Cleanup. We jump here on error. */
+    if (ctx->jump) {
+        releaseCode(ctx->jump);
+        ctx->jump = NULL;
+    }
+    if (c) releaseCode(c);
+    contUnwind(ctx,base);
+    return 1;
+}
+#ifdef AOCLA_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+/* Evaluate the program in the list 'l' in the specified context 'ctx'.
+ * Expects a list object. The list is compiled the first time it gets
+ * evaluated, then its compiled form is executed by vmExec().
+ *
+ * Return 1 on runtime erorr. Otherwise 0 is returned.
+ */
+int eval(aoclactx *ctx, obj *l) {
+    assert (l->type == OBJ_TYPE_LIST);
+    return vmExec(ctx,getListCode(ctx,l));
+}
+
+/* ============================== Machine code ==============================
+ * The JITs write x86-64 code in a jitbuf, a malloc()ed buffer, and copy
+ * it in executable memory only once done. The memory is obtained with
+ * mmap() and made executable, but no longer writable, before running it:
+ * it is never writable and executable at the same time.
+ * ========================================================================== */
+
+#ifdef AOCLA_JIT
+typedef struct jitbuf {
+    unsigned char *buf;
+    size_t len, alloc;
+} jitbuf;
+
+void jitEmit(jitbuf *jb, int byte) {
+    if (jb->len == jb->alloc) {
+        jb->alloc = jb->alloc ? jb->alloc*2 : 256;
+        jb->buf = myrealloc(jb->buf,jb->alloc);
+    }
+    jb->buf[jb->len++] = byte;
+}
+
+void jitEmit32(jitbuf *jb, int32_t v) {
+    for (int j = 0; j < 4; j++) jitEmit(jb,((uint32_t)v >> (j*8)) & 0xff);
+}
+
+void jitEmit64(jitbuf *jb, uint64_t v) {
+    for (int j = 0; j < 8; j++) jitEmit(jb,(v >> (j*8)) & 0xff);
+}
+
+/* Emit the REX prefix if 'w' (64 bit operand) is set or any of the
+ * registers is R8 or above. */
+void jitEmitRex(jitbuf *jb, int w, int reg, int rm) {
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) jitEmit(jb,rex);
+}
+
+/* Emit the 32 bit instruction 'opcode reg, rm' between registers. The
+ * opcode may be two bytes long, as for 0x0FAF (imul). */
+void jitEmitRR(jitbuf *jb, int opcode, int reg, int rm) {
+    jitEmitRex(jb,0,reg,rm);
+    if (opcode > 0xff) jitEmit(jb,opcode >> 8);
+    jitEmit(jb,opcode & 0xff);
+    jitEmit(jb,0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Emit 'opcode reg, [base+disp]', with a 64 bit operand if 'w' is set.
+ * RSP and R12 can't be used as base, since they need a SIB byte. */
+void jitEmitMem(jitbuf *jb, int w, int opcode, int reg, int base,
+                int32_t disp)
+{
+    jitEmitRex(jb,w,reg,base);
+    if (opcode > 0xff) jitEmit(jb,opcode >> 8);
+    jitEmit(jb,opcode & 0xff);
+    jitEmit(jb,0x80 | ((reg & 7) << 3) | (base & 7));
+    jitEmit32(jb,disp);
+}
+
+/* Emit 'mov reg,imm64'. */
+void jitEmitMov64(jitbuf *jb, int reg, uint64_t v) {
+    jitEmitRex(jb,1,0,reg);
+    jitEmit(jb,0xb8 | (reg & 7));
+    jitEmit64(jb,v);
+}
+
+/* Emit 'jcc rel32' (or 'jmp' if 'cc' is -1) to the offset 'target' of
+ * the buffer, returning the position of the displacement, so that the
+ * caller can patch it with jitPatchJump() if the target is not known
+ * yet. */
+size_t jitEmitJump(jitbuf *jb, int cc, size_t target) {
+    if (cc == -1) {
+        jitEmit(jb,0xe9);
+    } else {
+        jitEmit(jb,0x0f);
+        jitEmit(jb,0x80|cc);
+    }
+    size_t pos = jb->len;
+    jitEmit32(jb,(int32_t)(target-(pos+4)));
+    return pos;
+}
+
+void jitPatchJump(jitbuf *jb, size_t pos, size_t target) {
+    int32_t rel = target-(pos+4);
+    memcpy(jb->buf+pos,&rel,4);
+}
+
+/* Return the condition code of the comparison operator 'op' (see
+ * builtin.op), for setcc and jcc. */
+int jitCondCode(int op) {
+    static const char *ops = "<l>g=!";
+    static const int cc[] = {0xc, 0xe, 0xf, 0xd, 0x4, 0x5};
+    return cc[strchr(ops,op)-ops];
+}
+
+/* Copy the code in executable memory, and free the buffer. Returns the
+ * memory, mapped for '*size' bytes, or NULL on error. */
+void *jitMakeExecutable(jitbuf *jb, size_t *size) {
+    void *mem = mmap(NULL,jb->len,PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (mem != MAP_FAILED) {
+        memcpy(mem,jb->buf,jb->len);
+        if (mprotect(mem,jb->len,PROT_READ|PROT_EXEC) == -1) {
+            munmap(mem,jb->len);
+            mem = MAP_FAILED;
+        }
+    }
+    *size = jb->len;
+    free(jb->buf);
+    memset(jb,0,sizeof(*jb));
+    return mem == MAP_FAILED ? NULL : mem;
+}
+#endif
+
+/* ============================== Tracing JIT ===============================
+ * While loops running many iterations are compiled to x86-64 code. When
+ * the body of a loop becomes hot (AOCLA_JIT_THRESHOLD iterations), we
+ * record one iteration, body first and condition later, following the
+ * calls to small Aocla procedures as inlineCalls() would do: since the
+ * recorded code can't contain nested lists, one iteration is all the
+ * loop can do, and the trace is the whole loop. Recording specializes
+ * the code for the types observed: currently only loops working with
+ * integer local vars, integer literals, arithmetic, comparisons and the
+ * dup, swap and drop builtins are supported, the rest aborts the trace.
+ *
+ * The native code keeps the stack in registers and the local vars in an
+ * array of slots, loaded from the frame before the loop starts. The
+ * guards at the start of the native code check that the vars read have
+ * the integer type seen while recording: if not, the loop is executed
+ * by the interpreter. Once the guards passed no other check is needed,
+ * since the operations recorded can't fail nor change the types, so the
+ * loop runs natively till the condition is false, and the vars written
+ * are stored back into the frame.
+ *
+ * ========================================================================== */
+
+#ifdef AOCLA_JIT
+#ifndef AOCLA_JIT_THRESHOLD
+#define AOCLA_JIT_THRESHOLD 100 /* Iterations before recording a loop. */
+#endif
+#define TRACE_MAX_VARS 32       /* Max local vars used by a trace. */
+#define TRACE_MAX_PROCS 8       /* Max procedures inlined in a trace. */
+
+/* Registers holding the stack values, bottom first. EAX and EDX are
+ * used as scratch registers, and RDI points to the slots array. */
+static const int TraceRegs[] = {1 /* ECX */, 6 /* ESI */, 8, 9, 10, 11};
+#define TRACE_MAX_DEPTH ((int)(sizeof(TraceRegs)/sizeof(int)))
+
+typedef struct trace {
+    void *mem;                      /* Native code, see runTrace(). */
+    size_t size;                    /* Size of the mapping of 'mem'. */
+    code *cond;                     /* Condition code. Retained. */
+    int numvars;
+    int var[TRACE_MAX_VARS];        /* Var name of each slot. Names with
+                                       bit 8 set are vars of inlined
+                                       procedures, not in the frame. */
+    int written[TRACE_MAX_VARS];    /* True if the loop sets the var. */
+    int numprocs;                   /* Procedures inlined in the trace. */
+    obj *procsym[TRACE_MAX_PROCS];  /* Symbol called. Retained. */
+    obj *proc[TRACE_MAX_PROCS];     /* List it was bound to. Retained. */
+} trace;
+
+/* State of the recording. */
+typedef struct tracer {
+    aoclactx *ctx;
+    trace *t;
+    jitbuf jb;                      /* Code generated. */
+    int depth;                      /* Stack values in registers. */
+    int type[TRACE_MAX_DEPTH];      /* Their types, OBJ_TYPE_INT/BOOL. */
+    int slot[512];                  /* Var name -> slot+1, or 0. */
+    int guarded[TRACE_MAX_VARS];    /* Var read before being written. */
+    int error;                      /* Recording aborted. */
+} tracer;
+
+/* Emit 'opcode reg, [rdi+slot*8]'. */
+void traceEmitSlot(tracer *tr, int w, int opcode, int reg, int slot) {
+    jitEmitMem(&tr->jb,w,opcode,reg,7,slot*8);
+}
+
+/* Return the slot of the local var 'name', allocating one if needed, or
+ * -1 on error. 'read' tells if the var is read or written. */
+int traceVar(tracer *tr, int name, int read) {
+    trace *t = tr->t;
+    if (tr->slot[name] == 0) {
+        if (t->numvars == TRACE_MAX_VARS) return -1;
+        t->var[t->numvars] = name;
+        t->written[t->numvars] = 0;
+        /* Inlined procedures vars are always written before being read,
+         * see isInlinable(). The others must be in the frame, with the
+         * type we can handle. */
+        if (read) {
+            obj *val = getLocal(tr->ctx->frame,name);
+            if (val == NULL || OBJ_TYPE(val) != OBJ_TYPE_INT) return -1;
+        }
+        tr->guarded[t->numvars] = read;
+        tr->slot[name] = ++t->numvars;
+    }
+    int slot = tr->slot[name]-1;
+    if (!read && !(name & 256)) t->written[slot] = 1;
+    return slot;
+}
+
+/* Check that the stack has at least 'n' values of type 'type' on top,
+ * setting the error otherwise. Returns true on error. */
+int traceArgs(tracer *tr, int n, int type) {
+    if (tr->depth < n) return tr->error = 1;
+    for (int j = 1; j <= n; j++)
+        if (!(tr->type[tr->depth-j] & type)) return tr->error = 1;
+    return 0;
+}
+
+/* Push a value of the given type, returning its register. */
+int tracePush(tracer *tr, int type) {
+    if (tr->depth == TRACE_MAX_DEPTH) {
+        tr->error = 1;
+        return 0;
+    }
+    tr->type[tr->depth] = type;
+    return TraceRegs[tr->depth++];
+}
+
+void traceList(tracer *tr, obj *l, int rename);
+
+/* Record the call of the procedure 'proc' by the symbol 'sym'. */
+void traceCall(tracer *tr, obj *sym, aproc *proc, obj *prev) {
+    jitbuf *jb = &tr->jb;
+    int op = builtinOp(proc), a, b, type;
+
+    if (proc->proc) {
+        /* Follow calls to Aocla procedures we could inline, renaming
+         * their vars, and remembering them to check they are still
+         * bound to the same procedure before running the trace. */
+        trace *t = tr->t;
+        if (t->numprocs == TRACE_MAX_PROCS ||
+            !isInlinable(tr->ctx,proc->proc))
+        {
+            tr->error = 1;
+            return;
+        }
+        t->procsym[t->numprocs] = sym;
+        t->proc[t->numprocs] = proc->proc;
+        retain(sym);
+        retain(proc->proc);
+        t->numprocs++;
+        traceList(tr,proc->proc,256);
+        return;
+    }
+
+    /* Operands registers: 'b' is the top of the stack, 'a' the one
+     * below. */
+    a = tr->depth > 1 ? TraceRegs[tr->depth-2] : 0;
+    b = tr->depth > 0 ? TraceRegs[tr->depth-1] : 0;
+    if (op == '+' || op == '-' || op == '*' || op == '/') {
+        if (traceArgs(tr,2,OBJ_TYPE_INT)) return;
+        switch(op) {
+        case '+': jitEmitRR(jb,0x01,b,a); break;     /* add a,b */
+        case '-': jitEmitRR(jb,0x29,b,a); break;     /* sub a,b */
+        case '*': jitEmitRR(jb,0x0faf,a,b); break;   /* imul a,b */
+        case '/':
+            /* Division by zero would be an error: we only handle
+             * literal divisors. */
+            if (prev == NULL || OBJ_TYPE(prev) != OBJ_TYPE_INT ||
+                INT_VALUE(prev) == 0)
+            {
+                tr->error = 1;
+                return;
+            }
+            jitEmitRR(jb,0x89,a,0);     /* mov eax,a */
+            jitEmit(jb,0x99);           /* cdq */
+            jitEmitRR(jb,0xf7,7,b);     /* idiv b */
+            jitEmitRR(jb,0x89,0,a);     /* mov a,eax */
+            break;
+        }
+        tr->depth--;
+    } else if (op) {
+        /* Comparisons: setcc al, then zero extend into 'a'. */
+        if (traceArgs(tr,2,OBJ_TYPE_INT)) return;
+        jitEmitRR(jb,0x39,b,a);                         /* cmp a,b */
+        jitEmit(jb,0x0f);
+        jitEmit(jb,0x90 | jitCondCode(op));             /* setcc al */
+        jitEmit(jb,0xc0);
+        jitEmitRR(jb,0x0fb6,a,0);                       /* movzx a,al */
+        tr->depth -= 2;
+        tracePush(tr,OBJ_TYPE_BOOL);
+    } else if (proc->cproc == procDup) {
+        if (traceArgs(tr,1,OBJ_TYPE_INT|OBJ_TYPE_BOOL)) return;
+        a = tracePush(tr,tr->type[tr->depth-1]);
+        if (!tr->error) jitEmitRR(jb,0x89,b,a);     /* mov new,top */
+    } else if (proc->cproc == procSwap) {
+        if (traceArgs(tr,2,OBJ_TYPE_INT|OBJ_TYPE_BOOL)) return;
+        jitEmitRR(jb,0x89,a,0);     /* mov eax,a */
+        jitEmitRR(jb,0x89,b,a);     /* mov a,b */
+        jitEmitRR(jb,0x89,0,b);     /* mov b,eax */
+        type = tr->type[tr->depth-1];
+        tr->type[tr->depth-1] = tr->type[tr->depth-2];
+        tr->type[tr->depth-2] = type;
+    } else if (proc->cproc == procDrop) {
+        if (traceArgs(tr,1,OBJ_TYPE_INT|OBJ_TYPE_BOOL)) return;
+        tr->depth--;
+    } else {
+        tr->error = 1;
+    }
+}
+
+/* Record the execution of the list 'l'. 'rename' is ored to the names
+ * of the local vars, to separate the vars of inlined procedures. */
+void traceList(tracer *tr, obj *l, int rename) {
+    jitbuf *jb = &tr->jb;
+    for (size_t j = 0; j < l->l.len && !tr->error; j++) {
+        obj *o = listGet(l,j);
+        obj *prev = j ? listGet(l,j-1) : NULL;
+        int reg, slot;
+
+        switch(OBJ_TYPE(o)) {
+        case OBJ_TYPE_INT:
+            reg = tracePush(tr,OBJ_TYPE_INT);
+            if (tr->error) break;
+            jitEmitRex(jb,0,0,reg);
+            jitEmit(jb,0xb8 | (reg & 7));       /* mov reg,imm32 */
+            jitEmit32(jb,INT_VALUE(o));
+            break;
+        case OBJ_TYPE_TUPLE:
+            if (o->l.quoted || tr->depth < (int)o->l.len) {
+                tr->error = 1;
+                break;
+            }
+            for (size_t i = 0; i < o->l.len; i++) {
+                int name = (unsigned char)o->l.ele[i]->str.ptr[0] | rename;
+                int pos = tr->depth-o->l.len+i;
+                slot = traceVar(tr,name,0);
+                if (slot == -1 || tr->type[pos] != OBJ_TYPE_INT) {
+                    tr->error = 1;
+                    break;
+                }
+                traceEmitSlot(tr,0,0x89,TraceRegs[pos],slot);
+            }
+            tr->depth -= o->l.len;
+            break;
+        case OBJ_TYPE_SYMBOL:
+            if (o->str.quoted) {
+                tr->error = 1;
+            } else if (o->str.ptr[0] == '$') {
+                int name = (unsigned char)o->str.ptr[1] | rename;
+                if ((slot = traceVar(tr,name,1)) == -1) {
+                    tr->error = 1;
+                    break;
                 }
+                reg = tracePush(tr,OBJ_TYPE_INT);
+                if (tr->error) break;
+                traceEmitSlot(tr,0,0x8b,reg,slot);  /* mov reg,[slot] */
+            } else {
+                aproc *proc = lookupProcSymbol(tr->ctx,o->str.ptr);
+                if (proc == NULL) tr->error = 1;
+                else traceCall(tr,o,proc,prev);
             }
             break;
         default:
-            stackPush(ctx,o);
-            retain(o);
+            tr->error = 1;
             break;
         }
     }
+}
+
+/* Release a trace and its native code. */
+void releaseTrace(trace *t) {
+    if (t->mem) munmap(t->mem,t->size);
+    if (t->cond) releaseCode(t->cond);
+    for (int j = 0; j < t->numprocs; j++) {
+        release(t->procsym[j]);
+        release(t->proc[j]);
+    }
+    free(t);
+}
+
+/* Record the loop with condition 'cond' and body 'body' in the current
+ * frame, and return its trace, or NULL if the loop can't be traced. */
+trace *recordTrace(aoclactx *ctx, obj *cond, obj *body) {
+    tracer tr;
+    memset(&tr,0,sizeof(tr));
+    tr.ctx = ctx;
+    tr.t = myalloc(sizeof(trace));
+    memset(tr.t,0,sizeof(trace));
+
+    /* The guards are emitted later, once we know the vars read: the
+     * loop is recorded first, then moved after them. */
+    traceList(&tr,body,0);
+    if (tr.depth != 0) tr.error = 1;
+    traceList(&tr,cond,0);
+    if (tr.depth != 1 || tr.type[0] != OBJ_TYPE_BOOL) tr.error = 1;
+    if (tr.error) {
+        free(tr.jb.buf);
+        releaseTrace(tr.t);
+        return NULL;
+    }
+    jitbuf loop = tr.jb;
+    memset(&tr.jb,0,sizeof(tr.jb));
+
+    /* Guards: for each var read, load it from the slot, check it is an
+     * integer (tag bit set), and store back the untagged value. */
+    jitbuf *jb = &tr.jb;
+    size_t fail[TRACE_MAX_VARS];
+    int numfail = 0;
+    for (int j = 0; j < tr.t->numvars; j++) {
+        if (!tr.guarded[j]) continue;
+        traceEmitSlot(&tr,1,0x8b,0,j);              /* mov rax,[slot] */
+        jitEmit(jb,0xa8);                           /* test al,1 */
+        jitEmit(jb,OBJ_TAG_INT);
+        fail[numfail++] = jitEmitJump(jb,0x4,0);    /* jz fail */
+        jitEmitRex(jb,1,0,0);                       /* sar rax,1 */
+        jitEmit(jb,0xd1);
+        jitEmit(jb,0xf8);
+        traceEmitSlot(&tr,0,0x89,0,j);              /* mov [slot],eax */
+    }
+
+    /* The loop, repeated while the condition result is true. */
+    size_t top = jb->len;
+    for (size_t j = 0; j < loop.len; j++) jitEmit(jb,loop.buf[j]);
+    free(loop.buf);
+    jitEmitRR(jb,0x85,TraceRegs[0],TraceRegs[0]);   /* test r,r */
+    jitEmitJump(jb,0x5,top);                        /* jnz top */
+    jitEmit(jb,0x31);                               /* xor eax,eax */
+    jitEmit(jb,0xc0);
+    jitEmit(jb,0xc3);                               /* ret */
+    for (int j = 0; j < numfail; j++) jitPatchJump(jb,fail[j],jb->len);
+    jitEmit(jb,0xb8);                               /* mov eax,1 */
+    jitEmit32(jb,1);
+    jitEmit(jb,0xc3);                               /* ret */
+
+    trace *t = tr.t;
+    t->mem = jitMakeExecutable(jb,&t->size);
+    if (t->mem == NULL) {
+        releaseTrace(t);
+        return NULL;
+    }
+    return t;
+}
+
+/* Called by while when the condition is true, before executing the body.
+ * Count the iterations of the loop, recording it when it gets hot, and
+ * if a trace is available, run the loop with it. Returns 1 if the loop
+ * was executed to completion natively, 0 if it should be interpreted. */
+int runTrace(aoclactx *ctx, obj *cond, obj *body) {
+    code *bc = getListCode(ctx,body);
+    code *cc = getListCode(ctx,cond);
+    if (bc->trace == NULL) {
+        if (bc->hotness == -1 || ++bc->hotness < AOCLA_JIT_THRESHOLD ||
+            bc == cc) return 0;
+        bc->trace = recordTrace(ctx,cond,body);
+        if (bc->trace == NULL) {
+            bc->hotness = -1;
+            return 0;
+        }
+        bc->trace->cond = cc;
+        retainCode(cc);
+    }
+
+    /* The trace is valid only for the recorded condition, and if the
+     * procedures it calls were not redefined. */
+    trace *t = bc->trace;
+    if (t->cond != cc || BuiltinsRedefined) return 0;
+    for (int j = 0; j < t->numprocs; j++) {
+        aproc *proc = resolveProc(ctx,t->procsym[j]);
+        if (proc == NULL || proc->proc != t->proc[j]) return 0;
+    }
+
+    /* The native code gets the slots array in RDI, as the first argument
+     * of a C function, and returns 1 if a guard failed, 0 when the loop
+     * ended. */
+    int (*fn)(uintptr_t *slots);
+    *(void**)&fn = t->mem;
+    uintptr_t slots[TRACE_MAX_VARS];
+    for (int j = 0; j < t->numvars; j++)
+        slots[j] = t->var[j] & 256 ? 0 :
+                   (uintptr_t)getLocal(ctx->frame,t->var[j]);
+    if (fn(slots)) {
+        /* A guard failed: drop the trace, and interpret the loop until
+         * it gets hot again, recording it with the current types. */
+        releaseTrace(t);
+        bc->trace = NULL;
+        bc->hotness = 0;
+        return 0;
+    }
+    for (int j = 0; j < t->numvars; j++)
+        if (t->written[j])
+            setLocal(ctx->frame,t->var[j],newInt((int32_t)slots[j]));
+    return 1;
+}
+#endif
+
+/* ============================== Baseline JIT ==============================
+ * Code executed many times (procedures called AOCLA_BASELINE_THRESHOLD
+ * times, and lists run as many times by if, while, map and so forth) is
+ * compiled to native code, just stitching together a template for each
+ * instruction: the machine code of the template is copied, and patched
+ * with the operands of the instruction. Compiling is a single pass over
+ * the instructions, so it pays back even in short lived scripts.
+ *
+ * Most templates call a C function implementing the fast path of the
+ * instruction, that returns 1 if the fast path can't be used, for
+ * instance because a local var is not bound. In this case the native
+ * code returns to the VM, that executes the instruction normally,
+ * reporting errors and so forth. Pushing literals and local vars is
+ * done inline instead. Calls to builtins that don't execute code are
+ * direct calls of their C implementation, valid as long as no builtin
+ * was redefined, with the integer arithmetic and comparisons done
+ * inline. Everything else (calls to Aocla procedures, if, while, eval,
+ * ... and OP_RETURN) is left to the VM.
+ *
+ * The instructions with native code keep their opcode, but their label
+ * becomes the one of OP_NATIVE: when the VM dispatches one of them, it
+ * runs the native code from there, up to the first instruction the VM
+ * should execute. Since the templates implement what the instruction
+ * means, and not its current opcode, they remain valid when the VM
+ * rewrites the instructions later.
+ *
+ * In the native code RBX points to the context, and R12 to the
+ * instruction being executed, that is returned to the VM on exit.
+ * ========================================================================== */
+
+#ifdef AOCLA_BASELINE_JIT
+#ifndef AOCLA_BASELINE_THRESHOLD
+#define AOCLA_BASELINE_THRESHOLD 50 /* Executions before compiling code. */
+#endif
+
+typedef struct native {
+    void *mem; /* Native code, see runNative(). */
+    size_t size; /* Size of the mapping of 'mem'. */
+    uint32_t *offset;   /* Offset in 'mem' of the code of each
+                           instruction. */
+} native;
+
+/* Templates calling C functions: the functions return 0 if they executed
+ * the instruction 'ip', or 1 if the VM should execute it. */
+int nativeCapture(aoclactx *ctx, instr *ip) {
+    obj *o = ip->o;
+    if (ctx->stacklen < o->l.len) return 1;
+    ctx->stacklen -= o->l.len;
+    for (size_t i = 0; i < o->l.len; i++)
+        setLocal(ctx->frame,
+                 (unsigned char)o->l.ele[i]->str.ptr[0] | ip->var,
+                 ctx->stack[ctx->stacklen+i]);
+    return 0;
+}
+
+int nativeConst(aoclactx *ctx, instr *ip) {
+    if (BuiltinsRedefined) return 1;
+    stackPush(ctx,ip->aux);
+    retain(ip->aux);
     return 0;
 }
 
+int nativeInline(aoclactx *ctx, instr *ip) {
+    aproc *proc = resolveProc(ctx,ip->o);
+    return proc == NULL || proc->proc != ip->aux || BuiltinsRedefined;
+}
+
+/* Offsets of the fields used by the native code. */
+#define NATIVE_STACK ((int32_t)offsetof(aoclactx,stack))
+#define NATIVE_STACKLEN ((int32_t)offsetof(aoclactx,stacklen))
+#define NATIVE_STACKALLOC ((int32_t)offsetof(aoclactx,stackalloc))
+#define NATIVE_FRAME ((int32_t)offsetof(aoclactx,frame))
+#define NATIVE_CURPROC ((int32_t)offsetof(stackframe,curproc))
+#define NATIVE_CURLINE ((int32_t)offsetof(stackframe,curline))
+#define NATIVE_VARS ((int32_t)offsetof(stackframe,vars))
+#define NATIVE_NUMVARS ((int32_t)offsetof(stackframe,numvars))
+#define NATIVE_VARNAME ((int32_t)offsetof(localvar,name))
+#define NATIVE_REFCOUNT ((int32_t)offsetof(obj,refcount))
+
+/* Emit the bytes of 'code', 'len' bytes. */
+void nativeEmitBytes(jitbuf *jb, const char *code, size_t len) {
+    for (size_t j = 0; j < len; j++) jitEmit(jb,(unsigned char)code[j]);
+}
+
+/* Emit the call of the C function 'fn', with the context as first
+ * argument and 'arg' as second, returning to the VM if the function
+ * returns non zero. */
+void nativeEmitCall(jitbuf *jb, uintptr_t fn, uintptr_t arg, size_t exit) {
+    nativeEmitBytes(jb,"\x48\x89\xdf",3);           /* mov rdi,rbx */
+    jitEmitMov64(jb,6,arg);                         /* mov rsi,arg */
+    jitEmitMov64(jb,0,fn);                          /* mov rax,fn */
+    nativeEmitBytes(jb,"\xff\xd0\x85\xc0",4);       /* call rax */
+                                                    /* test eax,eax */
+    jitEmitJump(jb,0x5,exit);                       /* jnz exit */
+}
+
+/* Emit the template calling the function 'fn' for the instruction 'ip'. */
+void nativeEmitTemplate(jitbuf *jb, int (*fn)(aoclactx *, instr *),
+                        instr *ip, size_t exit)
+{
+    nativeEmitCall(jb,(uintptr_t)fn,(uintptr_t)ip,exit);
+}
+
+/* Emit the push of the object in RDX, retaining it if 'retain' is true.
+ * If the stack is full, the VM pushes it, growing the stack. */
+void nativeEmitPush(jitbuf *jb, int retain, size_t exit) {
+    jitEmitMem(jb,1,0x8b,0,3,NATIVE_STACKLEN);      /* mov rax,stacklen */
+    jitEmitMem(jb,1,0x3b,0,3,NATIVE_STACKALLOC);    /* cmp rax,stackalloc */
+    jitEmitJump(jb,0x3,exit);                       /* jae exit */
+    jitEmitMem(jb,1,0x8b,1,3,NATIVE_STACK);         /* mov rcx,stack */
+    nativeEmitBytes(jb,"\x48\x89\x14\xc1",4);       /* mov [rcx+rax*8],rdx */
+    nativeEmitBytes(jb,"\x48\xff\xc0",3);           /* inc rax */
+    jitEmitMem(jb,1,0x89,0,3,NATIVE_STACKLEN);      /* mov stacklen,rax */
+    if (!retain) return;
+
+    /* Like retain(): no-op for integers, booleans and immortal objects. */
+    nativeEmitBytes(jb,"\xf6\xc2",2);               /* test dl,tagmask */
+    jitEmit(jb,OBJ_TAG_MASK);
+    size_t imm = jitEmitJump(jb,0x5,0);             /* jnz done */
+    jitEmitMem(jb,0,0x81,7,2,NATIVE_REFCOUNT);      /* cmp refcount,immortal */
+    jitEmit32(jb,OBJ_REFCOUNT_IMMORTAL);
+    size_t immortal = jitEmitJump(jb,0x4,0);        /* je done */
+    jitEmitMem(jb,0,0xff,0,2,NATIVE_REFCOUNT);      /* inc refcount */
+    jitPatchJump(jb,imm,jb->len);
+    jitPatchJump(jb,immortal,jb->len);
+}
+
+/* Emit the push of the local var 'name'. If it is not bound, the VM
+ * reports the error. */
+void nativeEmitLocal(jitbuf *jb, int name, size_t exit) {
+    /* Scan the frame vars from RDX to RCX, as getLocal() does. */
+    jitEmitMem(jb,1,0x8b,0,3,NATIVE_FRAME);         /* mov rax,frame */
+    jitEmitMem(jb,1,0x63,1,0,NATIVE_NUMVARS);       /* movsxd rcx,numvars */
+    jitEmitMem(jb,1,0x8b,2,0,NATIVE_VARS);          /* mov rdx,vars */
+    nativeEmitBytes(jb,"\x48\x6b\xc9",3);           /* imul rcx,rcx,size */
+    jitEmit(jb,sizeof(localvar));
+    nativeEmitBytes(jb,"\x48\x01\xd1",3);           /* add rcx,rdx */
+    size_t loop = jb->len;
+    nativeEmitBytes(jb,"\x48\x39\xca",3);           /* cmp rdx,rcx */
+    jitEmitJump(jb,0x3,exit);                       /* jae exit */
+    jitEmitMem(jb,0,0x81,7,2,NATIVE_VARNAME);       /* cmp name,imm32 */
+    jitEmit32(jb,name);
+    size_t found = jitEmitJump(jb,0x4,0);           /* je found */
+    nativeEmitBytes(jb,"\x48\x83\xc2",3);           /* add rdx,size */
+    jitEmit(jb,sizeof(localvar));
+    jitEmitJump(jb,-1,loop);                        /* jmp loop */
+    jitPatchJump(jb,found,jb->len);
+    nativeEmitBytes(jb,"\x48\x8b\x12",3);           /* mov rdx,[rdx] */
+    nativeEmitPush(jb,1,exit);
+}
+
+/* Emit the call of the builtin 'proc' for the OP_CALL 'ip'. Arithmetic
+ * and comparison operators are computed inline if both the operands are
+ * integers. */
+void nativeEmitBuiltin(jitbuf *jb, instr *ip, aproc *proc, size_t exit,
+                       size_t error)
+{
+    const builtin *b = proc->builtin;
+    int op = b->op;
+    size_t slow[3], done = 0;
+
+    /* The symbol is still bound to the builtin if no builtin was
+     * redefined, see addProc(). The flag is per thread, but so is the
+     * code, that only the thread compiling it runs. */
+    jitEmitMov64(jb,0,(uintptr_t)&BuiltinsRedefined); /* mov rax,&flag */
+    nativeEmitBytes(jb,"\x83\x38\x00",3);           /* cmp dword [rax],0 */
+    jitEmitJump(jb,0x5,exit);                       /* jne exit */
+
+    if (op && op != '/') {
+        /* Load the operands 'a' and 'b', at [rcx+rax*8-16] and -8, in
+         * RDX and RSI, checking the tag bits. */
+        jitEmitMem(jb,1,0x8b,0,3,NATIVE_STACKLEN);  /* mov rax,stacklen */
+        nativeEmitBytes(jb,"\x48\x83\xf8\x02",4);   /* cmp rax,2 */
+        slow[0] = jitEmitJump(jb,0x2,0);            /* jb slow */
+        jitEmitMem(jb,1,0x8b,1,3,NATIVE_STACK);     /* mov rcx,stack */
+        nativeEmitBytes(jb,"\x48\x8b\x54\xc1\xf0",5); /* mov rdx,a */
+        nativeEmitBytes(jb,"\x48\x8b\x74\xc1\xf8",5); /* mov rsi,b */
+        nativeEmitBytes(jb,"\xf6\xc2\x01",3);       /* test dl,1 */
+        slow[1] = jitEmitJump(jb,0x4,0);            /* jz slow */
+        nativeEmitBytes(jb,"\x40\xf6\xc6\x01",4);   /* test sil,1 */
+        slow[2] = jitEmitJump(jb,0x4,0);            /* jz slow */
+
+        if (strchr("+-*",op)) {
+            /* Operate on the 32 bit values, like the VM does, and tag
+             * the result again. */
+            nativeEmitBytes(jb,"\x48\xd1\xfa",3);   /* sar rdx,1 */
+            nativeEmitBytes(jb,"\x48\xd1\xfe",3);   /* sar rsi,1 */
+            switch(op) {
+            case '+': jitEmitRR(jb,0x01,6,2); break; /* add edx,esi */
+            case '-': jitEmitRR(jb,0x29,6,2); break; /* sub edx,esi */
+            case '*': jitEmitRR(jb,0x0faf,2,6); break; /* imul edx,esi */
+            }
+            nativeEmitBytes(jb,"\x48\x63\xd2",3);   /* movsxd rdx,edx */
+            nativeEmitBytes(jb,"\x48\x8d\x54\x12\x01",5); /* tag: 2*rdx+1 */
+        } else {
+            /* Tagged integers compare like their values. */
+            nativeEmitBytes(jb,"\x48\x39\xf2",3);   /* cmp rdx,rsi */
+            jitEmit(jb,0x0f);                       /* setcc dl */
+            jitEmit(jb,0x90 | jitCondCode(op));
+            jitEmit(jb,0xc2);
+            nativeEmitBytes(jb,"\x0f\xb6\xd2",3);   /* movzx edx,dl */
+            nativeEmitBytes(jb,"\x48\x8d\x14\x95",4); /* lea rdx,[rdx*4+tag] */
+            jitEmit32(jb,OBJ_TAG_BOOL);
+        }
+        nativeEmitBytes(jb,"\x48\x89\x54\xc1\xf0",5); /* mov a,rdx */
+        nativeEmitBytes(jb,"\x48\xff\xc8",3);       /* dec rax */
+        jitEmitMem(jb,1,0x89,0,3,NATIVE_STACKLEN);  /* mov stacklen,rax */
+        done = jitEmitJump(jb,-1,0);                /* jmp done */
+        for (int j = 0; j < 3; j++) jitPatchJump(jb,slow[j],jb->len);
+    }
+
+    /* Arguments proved valid by analyzeList() are not checked again. The
+     * VM reports the errors. */
+    if (ip->checked != b)
+        nativeEmitCall(jb,(uintptr_t)matchBuiltinArgs,(uintptr_t)b,exit);
+
+    /* Call the builtin with the frame current procedure and line set,
+     * like the VM does, saving the current procedure in R13. */
+    jitEmitMem(jb,1,0x8b,0,3,NATIVE_FRAME);         /* mov rax,frame */
+    jitEmitMem(jb,0,0xc7,0,0,NATIVE_CURLINE);       /* mov curline,line */
+    jitEmit32(jb,ip->line);
+    jitEmitMem(jb,1,0x8b,13,0,NATIVE_CURPROC);      /* mov r13,curproc */
+    jitEmitMov64(jb,1,(uintptr_t)proc);             /* mov rcx,proc */
+    jitEmitMem(jb,1,0x89,1,0,NATIVE_CURPROC);       /* mov curproc,rcx */
+    nativeEmitBytes(jb,"\x48\x89\xdf",3);           /* mov rdi,rbx */
+    jitEmitMov64(jb,0,(uintptr_t)proc->cproc);      /* mov rax,cproc */
+    nativeEmitBytes(jb,"\xff\xd0",2);               /* call rax */
+    jitEmitMem(jb,1,0x8b,1,3,NATIVE_FRAME);         /* mov rcx,frame */
+    jitEmitMem(jb,1,0x89,13,1,NATIVE_CURPROC);      /* mov curproc,r13 */
+    nativeEmitBytes(jb,"\x85\xc0",2);               /* test eax,eax */
+    jitEmitJump(jb,0x5,error);                      /* jnz error */
+    if (done) jitPatchJump(jb,done,jb->len);
+}
+
+/* Release the native code. */
+void releaseNative(native *n) {
+    munmap(n->mem,n->size);
+    free(n->offset);
+    free(n);
+}
+
+/* Compile the code 'c' to native code, marking the instructions having
+ * native code with the OP_NATIVE label. */
+void compileNative(aoclactx *ctx, code *c) {
+    jitbuf jb;
+    memset(&jb,0,sizeof(jb));
+    uint32_t *offset = myalloc(sizeof(uint32_t)*c->len);
+    char *compiled = myalloc(c->len);
+    size_t *jump = myalloc(sizeof(size_t)*c->len);  /* Jumps to patch. */
+
+    /* The code is called as a C function with the context and the address
+     * of the code of the instruction to start from. It returns the
+     * instruction the VM should execute, or NULL on error. Callee saved
+     * registers are preserved, and three pushes keep the stack aligned
+     * for the calls. */
+    nativeEmitBytes(&jb,"\x53\x41\x54\x41\x55",5);  /* push rbx,r12,r13 */
+    nativeEmitBytes(&jb,"\x48\x89\xfb",3);          /* mov rbx,rdi */
+    nativeEmitBytes(&jb,"\xff\xe6",2);              /* jmp rsi */
+    size_t exit = jb.len;
+    nativeEmitBytes(&jb,"\x4c\x89\xe0",3);          /* mov rax,r12 */
+    size_t ret = jb.len;
+    nativeEmitBytes(&jb,"\x41\x5d\x41\x5c\x5b\xc3",6); /* pop r13,r12,rbx */
+                                                    /* ret */
+    size_t error = jb.len;
+    nativeEmitBytes(&jb,"\x31\xc0\xeb",3);          /* xor eax,eax */
+    jitEmit(&jb,(int)((ret-(jb.len+1)) & 0xff));    /* jmp ret */
+
+    /* Instructions without native code just return to the VM. The code
+     * always ends with OP_RETURN or OP_JUMP, so the native code of the
+     * last instruction does not continue past the end. */
+    for (size_t j = 0; j < c->len; j++) {
+        instr *ip = c->ins+j;
+        aproc *proc;
+        offset[j] = jb.len;
+        compiled[j] = 1;
+        jump[j] = 0;
+        jitEmitMov64(&jb,12,(uintptr_t)ip);         /* mov r12,ip */
+        switch(ip->op) {
+        case OP_PUSH:
+            jitEmitMov64(&jb,2,(uintptr_t)ip->o);   /* mov rdx,o */
+            nativeEmitPush(&jb,!IS_IMMEDIATE(ip->o),exit);
+            break;
+        case OP_LOCAL: case OP_LOCAL2: case OP_LOCAL_MATH:
+        case OP_LOCAL_MATH_SET: case OP_LOCAL_CMP: case OP_LOCAL_GET:
+            /* Superinstructions are executed like the instructions of
+             * the sequence, that are left in place. */
+            nativeEmitLocal(&jb,ip->var,exit);
+            break;
+        case OP_CAPTURE:
+            nativeEmitTemplate(&jb,nativeCapture,ip,exit);
+            break;
+        case OP_CONST:
+            nativeEmitTemplate(&jb,nativeConst,ip,exit);
+            jump[j] = jitEmitJump(&jb,-1,0);        /* jmp ip+var */
+            break;
+        case OP_INLINE:
+            nativeEmitTemplate(&jb,nativeInline,ip,exit);
+            jump[j] = jitEmitJump(&jb,-1,0);        /* jmp var */
+            break;
+        case OP_JUMP:
+            jump[j] = jitEmitJump(&jb,-1,0);        /* jmp var */
+            break;
+        case OP_CALL: case OP_CALL_INT_MATH: case OP_CALL_INT_CMP:
+        case OP_CALL_STR_CMP:
+            proc = resolveProc(ctx,ip->o);
+            if (!BuiltinsRedefined && proc && proc->builtin &&
+                proc->builtin->retc != BUILTIN_ANY_RET)
+            {
+                nativeEmitBuiltin(&jb,ip,proc,exit,error);
+                break;
+            }
+            /* Fall through. */
+        default:
+            compiled[j] = 0;
+            jitEmitJump(&jb,-1,exit);               /* jmp exit */
+            break;
+        }
+    }
+    for (size_t j = 0; j < c->len; j++) {
+        if (!jump[j]) continue;
+        size_t target = c->ins[j].op == OP_CONST ? j+c->ins[j].var :
+                                                   (size_t)c->ins[j].var;
+        jitPatchJump(&jb,jump[j],offset[target]);
+    }
+    free(jump);
+
+    native *n = myalloc(sizeof(*n));
+    n->offset = offset;
+    n->mem = jitMakeExecutable(&jb,&n->size);
+    if (n->mem == NULL) {
+        free(offset);
+        free(n);
+    } else {
+        c->native = n;
+        for (size_t j = 0; j < c->len; j++)
+            if (compiled[j]) c->ins[j].label = VMLabels[OP_NATIVE];
+    }
+    free(compiled);
+}
+
+/* Count the executions of the code 'c', compiling it when it gets hot. */
+void countExecution(aoclactx *ctx, code *c) {
+    if (c->calls < AOCLA_BASELINE_THRESHOLD &&
+        ++c->calls == AOCLA_BASELINE_THRESHOLD) compileNative(ctx,c);
+}
+
+/* Run the native code of 'c' from the instruction 'ip'. Returns the
+ * instruction the VM should execute next, or NULL on error. */
+instr *runNative(aoclactx *ctx, code *c, instr *ip) {
+    native *n = c->native;
+    instr *(*fn)(aoclactx *ctx, void *start);
+    *(void**)&fn = n->mem;
+    return fn(ctx,(char*)n->mem+n->offset[ip-c->ins]);
+}
+#endif
+
 /* ============================== Library ===================================
  * Here we implement a number of things useful to play with the language.
  * Performance is not really a concern here, so certain core things are
  * implemented in Aocla itself for the sake of brevity.
  * ========================================================================== */
 
+/* Shortcuts for the type masks of the builtins signatures. */
+#define T_ANY OBJ_TYPE_ANY
+#define T_INT OBJ_TYPE_INT
+#define T_LIST OBJ_TYPE_LIST
+#define T_SEQ (OBJ_TYPE_LIST|OBJ_TYPE_TUPLE|OBJ_TYPE_STRING)
+#define T_CAT (T_SEQ|OBJ_TYPE_SYMBOL)
+#define T_BOOL OBJ_TYPE_BOOL
+#define ANY_RET BUILTIN_ANY_RET
+
 /* Make sure the stack len is at least 'min' or set an error and return 1.
  * If there are enough elements 0 is returned. */
 int checkStackLen(aoclactx *ctx, size_t min) {
@@ -727,7 +4050,7 @@ int checkStackType(aoclactx *ctx, size_t count, ...) {
     va_start(ap, count);
     for (size_t i = 0; i < count; i++) {
         int type = va_arg(ap,int);
-        if (!(type & ctx->stack[ctx->stacklen-count+i]->type)) {
+        if (!(type & OBJ_TYPE(ctx->stack[ctx->stacklen-count+i]))) {
             setError(ctx,NULL,"Type mismatch");
             return 1;
         }
@@ -736,44 +4059,148 @@ int checkStackType(aoclactx *ctx, size_t count, ...) {
     return 0;
 }
 
-/* Search for a procedure with that name. Return NULL if not found. */
-aproc *lookupProc(aoclactx *ctx, const char *name) {
-    aproc *this = ctx->proc;
-    while(this) {
-        if (!strcmp(this->name,name)) return this;
-        this = this->next;
+/* Match the arguments on the stack against the signature of the builtin
+ * 'b'. Return 0 if they are valid, 1 if the stack is too short, 2 if the
+ * types don't match. */
+int matchBuiltinArgs(aoclactx *ctx, const builtin *b) {
+    if (ctx->stacklen < (size_t)b->argc) return 1;
+    obj **args = ctx->stack+ctx->stacklen-b->argc;
+    uint32_t types = 0;
+    for (int j = 0; j < b->argc; j++)
+        types |= (uint32_t)OBJ_TYPE(args[j]) << (j*8);
+    return (types & ~b->argtypes) ? 2 : 0;
+}
+
+/* Check the arguments on the stack against the signature of the builtin
+ * 'b', setting the same errors as checkStackType(). Return 1 on error,
+ * otherwise 0. */
+int checkBuiltinArgs(aoclactx *ctx, const builtin *b) {
+    int res = matchBuiltinArgs(ctx,b);
+    if (res) setError(ctx,NULL,res == 1 ? "Out of stack" : "Type mismatch");
+    return res != 0;
+}
+
+/* Return the operator code of the builtin arithmetic or comparison
+ * operator 'proc', or zero if 'proc' is NULL or something else. */
+int builtinOp(aproc *proc) {
+    return proc && proc->builtin ? proc->builtin->op : 0;
+}
+
+/* Initialize the procedures table 't' with 'size' empty slots. */
+void procTableInit(proctable *t, size_t size) {
+    t->table = myalloc(sizeof(aproc*)*size);
+    memset(t->table,0,sizeof(aproc*)*size);
+    t->size = size;
+    t->used = 0;
+}
+
+/* Store the procedure 'ap' in the first free slot of its probe sequence.
+ * The caller must make sure the procedure is not already in the table
+ * and that there is at least a free slot. */
+void procTableInsert(proctable *t, aproc *ap) {
+    size_t mask = t->size-1;
+    size_t idx = SYMHDR(ap->name)->hash & mask;
+    while(t->table[idx]) idx = (idx+1) & mask;
+    t->table[idx] = ap;
+    t->used++;
+}
+
+/* Search the procedure with the interned name 'name' inside 't'. */
+aproc *procTableFind(proctable *t, const char *name) {
+    size_t mask = t->size-1;
+    size_t idx = SYMHDR(name)->hash & mask;
+    aproc *ap;
+    while((ap = t->table[idx]) != NULL) {
+        if (ap->name == name) return ap;
+        idx = (idx+1) & mask;
     }
     return NULL;
 }
 
+/* If we are rehashing, migrate a few slots of the old table into the new
+ * one. Migrated procedures are not removed from the old table, otherwise
+ * the probe sequences of the procedures still to migrate would break:
+ * lookups just check the new table first. Once all the slots are
+ * migrated, the new table takes the place of the old one. */
+void procTableRehashStep(aoclactx *ctx) {
+    if (ctx->rehashidx == -1) return;
+    for (int j = 0; j < PROCTABLE_REHASH_STEPS; j++) {
+        aproc *ap = ctx->proc[0].table[ctx->rehashidx];
+        if (ap) procTableInsert(&ctx->proc[1],ap);
+        if ((size_t)++ctx->rehashidx == ctx->proc[0].size) {
+            free(ctx->proc[0].table);
+            ctx->proc[0] = ctx->proc[1];
+            ctx->proc[1].table = NULL;
+            ctx->proc[1].size = ctx->proc[1].used = 0;
+            ctx->rehashidx = -1;
+            return;
+        }
+    }
+}
+
+/* Search for a procedure with the interned name 'name'.
+ * Return NULL if not found. */
+aproc *lookupProcSymbol(aoclactx *ctx, const char *name) {
+    aproc *ap;
+
+    procTableRehashStep(ctx);
+    if (ctx->rehashidx != -1 &&
+        (ap = procTableFind(&ctx->proc[1],name)) != NULL) return ap;
+    return procTableFind(&ctx->proc[0],name);
+}
+
+/* Search for a procedure with that name. Return NULL if not found. */
+aproc *lookupProc(aoclactx *ctx, const char *name) {
+    return lookupProcSymbol(ctx,internSymbol(name,strlen(name)));
+}
+
 /* Allocate a new procedure object and link it to 'ctx'.
- * It's up to the caller to to fill the actual C or Aocla procedure pointer. */
+ * It's up to the caller to to fill the actual C or Aocla procedure pointer.
+ * The caller should make sure a procedure with the same name does not
+ * already exist. */
 aproc *newProc(aoclactx *ctx, const char *name) {
     aproc *ap = myalloc(sizeof(*ap));
-    ap->name = myalloc(strlen(name)+1);
-    memcpy((char*)ap->name,name,strlen(name)+1);
-    ap->next = ctx->proc;
-    ctx->proc = ap;
+    ap->name = internSymbol(name,strlen(name));
+
+    /* Start rehashing into a table of double the size when the load
+     * factor reaches 1/2. While rehashing, new procedures always go
+     * into the new table. */
+    if (ctx->rehashidx == -1 && ctx->proc[0].used*2 >= ctx->proc[0].size) {
+        procTableInit(&ctx->proc[1],ctx->proc[0].size*2);
+        ctx->rehashidx = 0;
+    }
+    procTableInsert(&ctx->proc[ctx->rehashidx == -1 ? 0 : 1],ap);
+    procTableRehashStep(ctx);
     return ap;
 }
 
+_Thread_local int BuiltinsRedefined = 0; /* True once a builtin gets
+                                           redefined in this thread. */
+
 /* Add a procedure to the specified context. Either cproc or list should
  * not be null, depending on the fact the new procedure is implemented as
  * a C function or natively in Aocla. If the procedure already exists it
- * is replaced with the new one. */
-void addProc(aoclactx *ctx, const char *name, int(*cproc)(aoclactx *), obj *list) {
+ * is replaced with the new one. The procedure is returned. */
+aproc *addProc(aoclactx *ctx, const char *name, int(*cproc)(aoclactx *),
+               obj *list)
+{
     assert((cproc != NULL) + (list != NULL) == 1);
     aproc *ap = lookupProc(ctx, name);
     if (ap) {
+        /* Code analyzed so far may assume the builtins semantics. */
+        if (ap->builtin) BuiltinsRedefined = 1;
         if (ap->proc != NULL) {
             release(ap->proc);
             ap->proc = NULL;
         }
+        ctx->epoch++; /* Invalidate cached lookups. */
     } else {
         ap = newProc(ctx,name);
     }
     ap->proc = list;
     ap->cproc = cproc;
+    ap->builtin = NULL;
+    return ap;
 }
 
 /* Add a procedure represented by the Aocla code 'prog', that must
@@ -785,27 +4212,33 @@ int addProcString(aoclactx *ctx, const char *name, const char *prog) {
     return 0;
 }
 
-/* Implements +, -, *, %, ... */
-int procBasicMath(aoclactx *ctx) {
-    if (checkStackType(ctx,2,OBJ_TYPE_INT,OBJ_TYPE_INT)) return 1;
+/* Implements +, -, *, /. The operator is one of the codes returned by
+ * callOperator(). */
+int basicMath(aoclactx *ctx, int op) {
     obj *b = stackPop(ctx);
     obj *a = stackPop(ctx);
 
-    int res;
-    const char *fname = ctx->frame->curproc->name;
-    if (fname[0] == '+' && fname[1] == 0) res = a->i + b->i;
-    if (fname[0] == '-' && fname[1] == 0) res = a->i - b->i;
-    if (fname[0] == '*' && fname[1] == 0) res = a->i * b->i;
-    if (fname[0] == '/' && fname[1] == 0) res = a->i / b->i;
+    int res, ai = INT_VALUE(a), bi = INT_VALUE(b);
+    switch(op) {
+    case '+': res = ai + bi; break;
+    case '-': res = ai - bi; break;
+    case '*': res = ai * bi; break;
+    case '/': res = ai / bi; break;
+    }
     stackPush(ctx,newInt(res));
     release(a);
     release(b);
     return 0;
 }
 
-/* Implements ==, >=, <=, !=. */
-int procCompare(aoclactx *ctx) {
-    if (checkStackLen(ctx,2)) return 1;
+int procAdd(aoclactx *ctx) { return basicMath(ctx,'+'); }
+int procSub(aoclactx *ctx) { return basicMath(ctx,'-'); }
+int procMul(aoclactx *ctx) { return basicMath(ctx,'*'); }
+int procDiv(aoclactx *ctx) { return basicMath(ctx,'/'); }
+
+/* Implements ==, !=, >, >=, <, <=. The operator is one of the codes
+ * returned by callOperator(). */
+int basicCompare(aoclactx *ctx, int op) {
     obj *b = stackPop(ctx);
     obj *a = stackPop(ctx);
     int cmp = compare(a,b);
@@ -817,19 +4250,13 @@ int procCompare(aoclactx *ctx) {
     }
 
     int res;
-    const char *fname = ctx->frame->curproc->name;
-    if (fname[1] == '=') {
-        switch(fname[0]) {
-        case '=': res = cmp == 0; break;
-        case '!': res = cmp != 0; break;
-        case '>': res = cmp >= 0; break;
-        case '<': res = cmp <= 0; break;
-        }
-    } else {
-        switch(fname[0]) {
-        case '>': res = cmp > 0; break;
-        case '<': res = cmp < 0; break;
-        }
+    switch(op) {
+    case '=': res = cmp == 0; break;
+    case '!': res = cmp != 0; break;
+    case '>': res = cmp > 0; break;
+    case 'g': res = cmp >= 0; break;
+    case '<': res = cmp < 0; break;
+    case 'l': res = cmp <= 0; break;
     }
     stackPush(ctx,newBool(res));
     release(a);
@@ -837,11 +4264,18 @@ int procCompare(aoclactx *ctx) {
     return 0;
 }
 
+int procEq(aoclactx *ctx) { return basicCompare(ctx,'='); }
+int procNe(aoclactx *ctx) { return basicCompare(ctx,'!'); }
+int procGt(aoclactx *ctx) { return basicCompare(ctx,'>'); }
+int procGe(aoclactx *ctx) { return basicCompare(ctx,'g'); }
+int procLt(aoclactx *ctx) { return basicCompare(ctx,'<'); }
+int procLe(aoclactx *ctx) { return basicCompare(ctx,'l'); }
+
 /* Implements sort. Sorts a list in place. */
 int procSortList(aoclactx *ctx) {
-    if (checkStackType(ctx,1,OBJ_TYPE_LIST)) return 1;
     obj *l = stackPop(ctx);
     l = getUnsharedObject(l);
+    listFlatten(l);
     qsort(l->l.ele,l->l.len,sizeof(obj*),qsort_obj_cmp);
     stackPush(ctx,l);
     return 0;
@@ -850,10 +4284,11 @@ int procSortList(aoclactx *ctx) {
 /* "def" let Aocla define new procedures, binding a list to a
  * symbol in the procedure table. */
 int procDef(aoclactx *ctx) {
-    if (checkStackType(ctx,2,OBJ_TYPE_LIST,OBJ_TYPE_SYMBOL)) return 1;
     obj *sym = stackPop(ctx);
     obj *code = stackPop(ctx);
     addProc(ctx,sym->str.ptr,NULL,code);
+    /* Just to report warnings. */
+    analyzeList(NULL,code,NULL,sym->str.ptr,NULL);
     release(sym);
     return 0;
 }
@@ -868,79 +4303,113 @@ int procDef(aoclactx *ctx) {
  * we don't have tail recursion implemented), making every other thing
  * using while a issue with the stack length. Also stack trace on error
  * is a mess. And if you see the implementation, while is mostly an obvious
- * result of the ifelse implementation itself. */
-int procIf(aoclactx *ctx) {
-    int w = ctx->frame->curproc->name[0] == 'w';        /* while? */
-    int e = ctx->frame->curproc->name[2] == 'e';        /* ifelse? */
-    int retval = 1;
-    if (e) {
-        if (checkStackType(ctx,3,OBJ_TYPE_LIST,OBJ_TYPE_LIST,OBJ_TYPE_LIST))
-            return 1;
-    } else {
-        if (checkStackType(ctx,2,OBJ_TYPE_LIST,OBJ_TYPE_LIST))
-            return 1;
-    }
+ * result of the ifelse implementation itself.
+ *
+ * The condition and the branches are not evaluated here: we push a
+ * continuation and ask the VM to execute the condition. Once it returns,
+ * resumeIf() or resumeWhile() check the result and select what to
+ * execute next. */
+int resumeIf(aoclactx *ctx, cont *k);
+int resumeWhile(aoclactx *ctx, cont *k);
+int startIf(aoclactx *ctx, int ifelse, int(*resume)(aoclactx*,cont*)) {
+    cont *k = contPush(ctx,CONT_CPROC);
+    if (k == NULL) return 1;
+    k->resume = resume;
+    k->curproc = ctx->frame->curproc;
+    k->r = ifelse ? stackPop(ctx) : NULL;   /* Else branch. */
+    k->b = stackPop(ctx);                   /* If branch or while body. */
+    k->a = stackPop(ctx);                   /* Condition. */
+    vmJump(ctx,getListCode(ctx,k->a));
+    return 0;
+}
 
-    obj *elsebranch, *ifbranch, *cond;
-    elsebranch = e ? stackPop(ctx) : NULL;
-    ifbranch = stackPop(ctx);
-    cond = stackPop(ctx);
+int procIf(aoclactx *ctx) { return startIf(ctx,0,resumeIf); }
+int procIfElse(aoclactx *ctx) { return startIf(ctx,1,resumeIf); }
+int procWhile(aoclactx *ctx) { return startIf(ctx,0,resumeWhile); }
 
-    while(1) {
-        /* Evaluate the conditional program. */
-        if (eval(ctx,cond)) goto rterr;
-        if (checkStackType(ctx,1,OBJ_TYPE_BOOL)) goto rterr;
-        obj *condres = stackPop(ctx);
-        int res = condres->istrue;
-        release(condres);
-
-        /* Now eval the true or false branch depending on the
-         * result. */
-        if (res) { /* True branch (if, ifelse, while). */
-            if (eval(ctx,ifbranch)) goto rterr;
-            if (w) continue;
-        } else if (e) { /* False branch (ifelse). */
-            if (eval(ctx,elsebranch)) goto rterr;
-        }
-        break;
+/* Pop the boolean result of the condition and store it in 'res'. Return
+ * 1 on error (not a boolean), otherwise 0. */
+int popCondition(aoclactx *ctx, cont *k, int *res) {
+    ctx->frame->curproc = k->curproc;
+    if (checkStackType(ctx,1,OBJ_TYPE_BOOL)) return 1;
+    obj *condres = stackPop(ctx);
+    *res = BOOL_VALUE(condres);
+    release(condres);
+    return 0;
+}
+
+/* Called when the condition of if and ifelse returned. The branch is
+ * executed in place of the continuation, so that calls in tail position
+ * inside the branch are tail calls. */
+int resumeIf(aoclactx *ctx, cont *k) {
+    int res;
+    if (popCondition(ctx,k,&res)) return 1;
+    obj *branch = res ? k->b : k->r;
+    if (branch) vmJump(ctx,getListCode(ctx,branch));
+    contPop(ctx);
+    return 0;
+}
+
+/* Called when the condition (k->idx == 0) or the body (k->idx == 1) of
+ * while returned. */
+int resumeWhile(aoclactx *ctx, cont *k) {
+    int res;
+    if (k->idx == 1) {
+        ctx->frame->curproc = k->curproc;
+        k->idx = 0;
+        vmJump(ctx,getListCode(ctx,k->a));
+        return 0;
     }
-    retval = 0; /* Success. */
 
-rterr:  /* Cleanup. We jump here on error with retval = 1. */
-    release(cond);
-    release(ifbranch);
-    release(elsebranch);
-    return retval;
+    if (popCondition(ctx,k,&res)) return 1;
+    if (res) {
+#ifdef AOCLA_JIT
+        if (runTrace(ctx,k->a,k->b)) {
+            contPop(ctx);
+            return 0;
+        }
+#endif
+        k->idx = 1;
+        vmJump(ctx,getListCode(ctx,k->b));
+    } else {
+        contPop(ctx);
+    }
+    return 0;
 }
 
-/* Evaluate the given list, consuming it. */
 int procEval(aoclactx *ctx) {
-    if (checkStackType(ctx,1,OBJ_TYPE_LIST)) return 1;
     obj *l = stackPop(ctx);
-    int retval = eval(ctx,l);
+    vmJump(ctx,getListCode(ctx,l));
     release(l);
-    return retval;
+    return 0;
 }
 
 /* Like eval, but the code is evaluated in the stack frame of the calling
- * procedure, if any. */
+ * procedure, if any: we switch frame, and push a continuation to restore
+ * the current frame once the code returns. */
+int resumeUpeval(aoclactx *ctx, cont *k) {
+    ctx->frame = k->frame;
+    contPop(ctx);
+    return 0;
+}
+
 int procUpeval(aoclactx *ctx) {
-    if (checkStackType(ctx,1,OBJ_TYPE_LIST)) return 1;
-    obj *l = stackPop(ctx);
-    stackframe *saved = NULL;
     if (ctx->frame->prev) {
-        saved = ctx->frame;
+        cont *k = contPush(ctx,CONT_CPROC);
+        if (k == NULL) return 1;
+        k->resume = resumeUpeval;
+        k->curproc = ctx->frame->curproc;
+        k->frame = ctx->frame;
         ctx->frame = ctx->frame->prev;
     }
-    int retval = eval(ctx,l);
-    if (saved) ctx->frame = saved;
+    obj *l = stackPop(ctx);
+    vmJump(ctx,getListCode(ctx,l));
     release(l);
-    return retval;
+    return 0;
 }
 
 /* Print the top object to stdout, consuming it */
 int procPrint(aoclactx *ctx) {
-    if (checkStackLen(ctx,1)) return 1;
     obj *o = stackPop(ctx);
     printobj(o,PRINT_RAW);
     release(o);
@@ -949,7 +4418,6 @@ int procPrint(aoclactx *ctx) {
 
 /* Like print but also prints a newline at the end. */
 int procPrintnl(aoclactx *ctx) {
-    if (checkStackLen(ctx,1)) return 1;
     int ret = procPrint(ctx); printf("\n");
     return ret;
 }
@@ -957,12 +4425,9 @@ int procPrintnl(aoclactx *ctx) {
 /* Len -- gets object len. Works with many types.
  * (object) => (len) */
 int procLen(aoclactx *ctx) {
-    if (checkStackType(ctx,1,OBJ_TYPE_LIST|OBJ_TYPE_TUPLE|OBJ_TYPE_STRING|
-                             OBJ_TYPE_SYMBOL)) return 1;
-
     obj *o = stackPop(ctx);
     int len;
-    switch(o->type) {
+    switch(OBJ_TYPE(o)) {
     case OBJ_TYPE_LIST: case OBJ_TYPE_TUPLE:    len = o->l.len; break;
     case OBJ_TYPE_STRING: case OBJ_TYPE_SYMBOL: len = o->str.len; break;
     }
@@ -975,32 +4440,24 @@ int procLen(aoclactx *ctx) {
  *
  * (x [1 2 3]) => ([1 2 3 x]) | ([x 1 2 3])
  *
- * <- is very inefficient as it memmoves all N elements. */
-int procListAppend(aoclactx *ctx) {
-    int tail = ctx->frame->curproc->name[0] == '-';     /* Append on tail? */
-    if (checkStackType(ctx,2,OBJ_TYPE_ANY,OBJ_TYPE_LIST)) return 1;
+ * Both are amortized O(1) if the list is not shared, see listMakeRoom(). */
+int listAppend(aoclactx *ctx, int where) {
     obj *l = getUnsharedObject(stackPop(ctx));
     obj *ele = stackPop(ctx);
-    l->l.ele = myrealloc(l->l.ele,sizeof(obj*)*(l->l.len+1));
-    if (tail) {
-        l->l.ele[l->l.len] = ele;
-    } else {
-        memmove(l->l.ele+1,l->l.ele,sizeof(obj*)*l->l.len);
-        l->l.ele[0] = ele;
-    }
-    l->l.len++;
+    listAdd(l,ele,where);
     stackPush(ctx,l);
     return 0;
 }
 
+int procAppendTail(aoclactx *ctx) { return listAppend(ctx,LIST_TAIL); }
+int procAppendHead(aoclactx *ctx) { return listAppend(ctx,LIST_HEAD); }
+
 /* get@ -- get element at index. Works for lists, strings, tuples.
  * (object index) => (element). */
 int procListGetAt(aoclactx *ctx) {
-    if (checkStackType(ctx,2,OBJ_TYPE_LIST|OBJ_TYPE_STRING|OBJ_TYPE_TUPLE,
-                             OBJ_TYPE_INT)) return 1;
     obj *idx = stackPop(ctx);
     obj *o = stackPop(ctx);
-    int i = idx->i;
+    int i = INT_VALUE(idx);
     size_t len = o->type == OBJ_TYPE_STRING ? o->str.len : o->l.len;
     if (i < 0) i = len+i; /* -1 is last element, and so forth. */
     release(idx);
@@ -1010,8 +4467,9 @@ int procListGetAt(aoclactx *ctx) {
         if (o->type == OBJ_TYPE_STRING) {
             stackPush(ctx,newString(o->str.ptr+i,1));
         } else {
-            stackPush(ctx,o->l.ele[i]);
-            retain(o->l.ele[i]);
+            obj *ele = listGet(o,i);
+            stackPush(ctx,ele);
+            retain(ele);
         }
     }
     release(o);
@@ -1021,34 +4479,35 @@ int procListGetAt(aoclactx *ctx) {
 /* cat -- Concatenates lists, tuples, strings.
  * (a b) => (a#b) */
 int procCat(aoclactx *ctx) {
-    if (checkStackLen(ctx,2)) return 1;
-    if (ctx->stack[ctx->stacklen-1]->type !=
-        ctx->stack[ctx->stacklen-2]->type)
+    if (OBJ_TYPE(ctx->stack[ctx->stacklen-1]) !=
+        OBJ_TYPE(ctx->stack[ctx->stacklen-2]))
     {
         setError(ctx,NULL,"cat expects two objects of the same type");
         return 1;
     }
 
-    if (checkStackType(ctx,2,OBJ_TYPE_LIST|OBJ_TYPE_STRING|
-                             OBJ_TYPE_TUPLE|OBJ_TYPE_SYMBOL,
-                             OBJ_TYPE_LIST|OBJ_TYPE_STRING|
-                             OBJ_TYPE_TUPLE|OBJ_TYPE_SYMBOL))
-        return 1;
-
+    if (checkStackType(ctx,2,T_CAT,T_CAT)) return 1;
     obj *src = stackPop(ctx);
     obj *dst = stackPeek(ctx,0);
     dst = getUnsharedObject(dst);
     stackSet(ctx,0,dst);
 
-    if (src->type & (OBJ_TYPE_STRING|OBJ_TYPE_SYMBOL)) {
-        dst->str.ptr = myrealloc(dst->str.ptr,dst->str.len+src->str.len+1);
+    if (src->type == OBJ_TYPE_SYMBOL) {
+        /* Symbol names are interned, so we need to intern the
+         * concatenation instead of modifying the name in place. */
+        size_t len = dst->str.len+src->str.len;
+        char *buf = myalloc(len+1);
+        memcpy(buf,dst->str.ptr,dst->str.len);
+        memcpy(buf+dst->str.len,src->str.ptr,src->str.len+1);
+        dst->str.ptr = (char*)internSymbol(buf,len);
+        dst->str.len = len;
+        free(buf);
+    } else if (src->type == OBJ_TYPE_STRING) {
+        dst->str.ptr = bufRealloc(dst->str.ptr,dst->str.len+src->str.len+1);
         memcpy(dst->str.ptr+dst->str.len,src->str.ptr,src->str.len+1);
         dst->str.len += src->str.len;
     } else {
-        for (size_t j = 0; j < src->l.len; j++) retain(src->l.ele[j]);
-        dst->l.ele = myrealloc(dst->l.ele,(dst->l.len+src->l.len)*sizeof(obj*));
-        memcpy(dst->l.ele+dst->l.len,src->l.ele,src->l.len*sizeof(obj*));
-        dst->l.len += src->l.len;
+        listCat(dst,src);
     }
     release(src);
     return 0;
@@ -1056,9 +4515,9 @@ int procCat(aoclactx *ctx) {
 
 // Turns the list on the stack into a tuple.
 int procMakeTuple(aoclactx *ctx) {
-    if (checkStackType(ctx,1,OBJ_TYPE_LIST)) return 1;
     obj *l = stackPop(ctx);
     l = getUnsharedObject(l);
+    listFlatten(l); /* Tuples are always flat. */
     l->type = OBJ_TYPE_TUPLE;
     l->l.quoted = 0;
     stackPush(ctx,l);
@@ -1071,35 +4530,171 @@ int procShowStack(aoclactx *ctx) {
     return 0;
 }
 
+/* Show the memory allocator statistics. */
+int procMemStats(aoclactx *ctx) {
+    NOTUSED(ctx);
+    allocatorShowStats();
+    return 0;
+}
+
+/* The following procedures are also implemented in Aocla itself at the
+ * end of loadLibrary(), but they are used so often in inner loops that
+ * a C implementation is worth it. Compile with AOCLA_SCRIPT_LIB defined
+ * in order to use the Aocla versions, for instance to compare the
+ * behavior of the two. */
+
+/* dup, swap, drop. */
+int procDup(aoclactx *ctx) {
+    obj *top = stackPeek(ctx,0);
+    stackPush(ctx,top);
+    retain(top);
+    return 0;
+}
+
+int procSwap(aoclactx *ctx) {
+    obj **top = ctx->stack+ctx->stacklen-1;
+    obj *tmp = top[0];
+    top[0] = top[-1];
+    top[-1] = tmp;
+    return 0;
+}
+
+int procDrop(aoclactx *ctx) {
+    release(stackPop(ctx));
+    return 0;
+}
+
+/* Return a new reference to the element at 'idx' of the list, tuple or
+ * string 'o'. */
+obj *getElement(obj *o, size_t idx) {
+    if (o->type == OBJ_TYPE_STRING) return newString(o->str.ptr+idx,1);
+    obj *ele = listGet(o,idx);
+    retain(ele);
+    return ele;
+}
+
+/* map, foreach: call the procedure 'f' with each element of the list 'l'.
+ * Like the Aocla versions, that use upeval, 'f' runs in the context of
+ * the caller, so it can access and set its local variables. We push a
+ * continuation with the list (k->a), the procedure (k->b), the result
+ * for map (k->r) and the current index (k->idx), and let the VM call
+ * 'f' for the first element. resumeMap() continues with the next ones. */
+int resumeMap(aoclactx *ctx, cont *k);
+int startMap(aoclactx *ctx, int map) {
+    cont *k = contPush(ctx,CONT_CPROC);
+    if (k == NULL) return 1;
+    k->resume = resumeMap;
+    k->curproc = ctx->frame->curproc;
+    k->b = stackPop(ctx);
+    k->a = stackPop(ctx);
+    k->r = map ? newList() : NULL;
+    k->idx = (size_t)-1; /* resumeMap() will start from index zero. */
+    return resumeMap(ctx,k);
+}
+
+int procMap(aoclactx *ctx) { return startMap(ctx,1); }
+int procForeach(aoclactx *ctx) { return startMap(ctx,0); }
+
+/* Called after 'f' returned, and to start the iteration. */
+int resumeMap(aoclactx *ctx, cont *k) {
+    obj *l = k->a;
+    size_t len = l->type == OBJ_TYPE_STRING ? l->str.len : l->l.len;
+    ctx->frame->curproc = k->curproc;
+    if (k->r && k->idx != (size_t)-1) {
+        if (checkStackLen(ctx,1)) return 1;
+        listAdd(k->r,stackPop(ctx),LIST_TAIL);
+    }
+
+    /* Note that we access the elements by index at every iteration: 'f'
+     * may share and modify 'l', changing its representation. */
+    if (++k->idx < len) {
+        stackPush(ctx,getElement(l,k->idx));
+        vmJump(ctx,getListCode(ctx,k->b));
+        return 0;
+    }
+    if (k->r) {
+        stackPush(ctx,k->r);
+        k->r = NULL;
+    }
+    contPop(ctx);
+    return 0;
+}
+
+/* first, rest. */
+int firstRest(aoclactx *ctx, int first) {
+    obj *o = stackPop(ctx);
+    size_t len = o->type == OBJ_TYPE_STRING ? o->str.len : o->l.len;
+
+    if (first) {
+        stackPush(ctx,len ? getElement(o,0) : newBool(0));
+    } else if (o->type == OBJ_TYPE_LIST) {
+        o = getUnsharedObject(o);
+        if (len) listSlice(o,1,len-1);
+        stackPush(ctx,o);
+        return 0;
+    } else {
+        /* Tuples and strings: rest always returns a list. */
+        obj *l = newList();
+        for (size_t j = 1; j < len; j++)
+            listAdd(l,getElement(o,j),LIST_TAIL);
+        stackPush(ctx,l);
+    }
+    release(o);
+    return 0;
+}
+
+int procFirst(aoclactx *ctx) { return firstRest(ctx,1); }
+int procRest(aoclactx *ctx) { return firstRest(ctx,0); }
+
+/* The builtins table, with the signature of each procedure implemented
+ * in C. See the builtin structure for the meaning of the fields. */
+const builtin Builtins[] = {
+    {"+", procAdd, ARGS2(T_INT,T_INT), 1, T_INT, '+'},
+    {"-", procSub, ARGS2(T_INT,T_INT), 1, T_INT, '-'},
+    {"*", procMul, ARGS2(T_INT,T_INT), 1, T_INT, '*'},
+    {"/", procDiv, ARGS2(T_INT,T_INT), 1, T_INT, '/'},
+    {"==", procEq, ARGS2(T_ANY,T_ANY), 1, T_BOOL, '='},
+    {"!=", procNe, ARGS2(T_ANY,T_ANY), 1, T_BOOL, '!'},
+    {">", procGt, ARGS2(T_ANY,T_ANY), 1, T_BOOL, '>'},
+    {">=", procGe, ARGS2(T_ANY,T_ANY), 1, T_BOOL, 'g'},
+    {"<", procLt, ARGS2(T_ANY,T_ANY), 1, T_BOOL, '<'},
+    {"<=", procLe, ARGS2(T_ANY,T_ANY), 1, T_BOOL, 'l'},
+    {"sort", procSortList, ARGS1(T_LIST), 1, T_LIST, 0},
+    {"def", procDef, ARGS2(T_LIST,OBJ_TYPE_SYMBOL), 0, 0, 0},
+    {"if", procIf, ARGS2(T_LIST,T_LIST), ANY_RET, T_ANY, 0},
+    {"ifelse", procIfElse, ARGS3(T_LIST,T_LIST,T_LIST), ANY_RET, T_ANY, 0},
+    {"while", procWhile, ARGS2(T_LIST,T_LIST), ANY_RET, T_ANY, 0},
+    {"eval", procEval, ARGS1(T_LIST), ANY_RET, T_ANY, 0},
+    {"upeval", procUpeval, ARGS1(T_LIST), ANY_RET, T_ANY, 0},
+    {"print", procPrint, ARGS1(T_ANY), 0, 0, 0},
+    {"printnl", procPrintnl, ARGS1(T_ANY), 0, 0, 0},
+    {"len", procLen, ARGS1(T_CAT), 1, T_INT, 0},
+    {"->", procAppendTail, ARGS2(T_ANY,T_LIST), 1, T_LIST, 0},
+    {"<-", procAppendHead, ARGS2(T_ANY,T_LIST), 1, T_LIST, 0},
+    {"get@", procListGetAt, ARGS2(T_SEQ,T_INT), 1, T_ANY, 0},
+    {"showstack", procShowStack, ARGS0, 0, 0, 0},
+    {"memstats", procMemStats, ARGS0, 0, 0, 0},
+    /* cat checks the types itself, to report mismatching types first. */
+    {"cat", procCat, ARGS2(T_ANY,T_ANY), 1, T_ANY, 0},
+    {"make-tuple", procMakeTuple, ARGS1(T_LIST), 1, OBJ_TYPE_TUPLE, 0},
+#ifndef AOCLA_SCRIPT_LIB
+    {"dup", procDup, ARGS1(T_ANY), 2, T_ANY, 0},
+    {"swap", procSwap, ARGS2(T_ANY,T_ANY), 2, T_ANY, 0},
+    {"drop", procDrop, ARGS1(T_ANY), 0, 0, 0},
+    {"map", procMap, ARGS2(T_SEQ,T_LIST), ANY_RET, T_ANY, 0},
+    {"foreach", procForeach, ARGS2(T_SEQ,T_LIST), ANY_RET, T_ANY, 0},
+    {"first", procFirst, ARGS1(T_SEQ), 1, T_ANY, 0},
+    {"rest", procRest, ARGS1(T_SEQ), 1, T_LIST, 0},
+#endif
+    {NULL, NULL, ARGS0, 0, 0, 0}
+};
+
 /* Load the "standard library" of Aocla in the specified context. */
 void loadLibrary(aoclactx *ctx) {
-    addProc(ctx,"+",procBasicMath,NULL);
-    addProc(ctx,"-",procBasicMath,NULL);
-    addProc(ctx,"*",procBasicMath,NULL);
-    addProc(ctx,"/",procBasicMath,NULL);
-    addProc(ctx,"==",procCompare,NULL);
-    addProc(ctx,">=",procCompare,NULL);
-    addProc(ctx,">",procCompare,NULL);
-    addProc(ctx,"<=",procCompare,NULL);
-    addProc(ctx,"<",procCompare,NULL);
-    addProc(ctx,"!=",procCompare,NULL);
-    addProc(ctx,"sort",procSortList,NULL);
-    addProc(ctx,"def",procDef,NULL);
-    addProc(ctx,"if",procIf,NULL);
-    addProc(ctx,"ifelse",procIf,NULL);
-    addProc(ctx,"while",procIf,NULL);
-    addProc(ctx,"eval",procEval,NULL);
-    addProc(ctx,"upeval",procUpeval,NULL);
-    addProc(ctx,"print",procPrint,NULL);
-    addProc(ctx,"printnl",procPrintnl,NULL);
-    addProc(ctx,"len",procLen,NULL);
-    addProc(ctx,"->",procListAppend,NULL);
-    addProc(ctx,"<-",procListAppend,NULL);
-    addProc(ctx,"get@",procListGetAt,NULL);
-    addProc(ctx,"showstack",procShowStack,NULL);
-    addProc(ctx,"cat",procCat,NULL);
-    addProc(ctx,"make-tuple",procMakeTuple,NULL);
+    for (const builtin *b = Builtins; b->name; b++)
+        addProc(ctx,b->name,b->cproc,NULL)->builtin = b;
 
+#ifdef AOCLA_SCRIPT_LIB
     /* Since the point of this interpreter to be a short and understandable
      * programming example, we implement as much as possible in Aocla itself
      * without caring much about performances. */
@@ -1118,6 +4713,7 @@ void loadLibrary(aoclactx *ctx) {
 
     /* [1 2 3] rest => [2 3] */
     addProcString(ctx,"rest","[#t (f) [] (n) [[$f] [#f (f) drop] [$n -> (n)] ifelse] foreach $n]");
+#endif
 }
 
 /* ================================ CLI ===================================== */
@@ -1156,13 +4752,14 @@ void repl(void) {
     }
 }
 
-/* Execute the program contained in the specified filename.
- * Return 1 on error, 0 otherwise. */
-int evalFile(const char *filename, char **argv, int argc) {
+/* Load the program contained in the specified filename, surrounded by
+ * [], since Aocla programs are lists. Return the program source as a
+ * null terminated string, or NULL if the file can't be read. */
+char *readProgram(const char *filename) {
     FILE *fp = fopen(filename,"r");
     if (!fp) {
         perror("Opening file");
-        return 1;
+        return NULL;
     }
 
     /* Read file into buffer. */
@@ -1183,6 +4780,28 @@ int evalFile(const char *filename, char **argv, int argc) {
     buf[buflen++] = ']';
     buf[buflen++] = 0;
     fclose(fp);
+    return buf;
+}
+
+/* Push the command line arguments on the stack, parsed as Aocla
+ * objects. Return 1 on parsing error, 0 otherwise. */
+int pushArguments(aoclactx *ctx, char **argv, int argc) {
+    for (int j = 0; j < argc; j++) {
+        obj *o = parseObject(NULL,argv[j],NULL,0);
+        if (!o) {
+            printf("Parsing command line argument: %s\n", ctx->errstr);
+            return 1;
+        }
+        stackPush(ctx,o);
+    }
+    return 0;
+}
+
+/* Execute the program contained in the specified filename.
+ * Return 1 on error, 0 otherwise. */
+int evalFile(const char *filename, char **argv, int argc) {
+    char *buf = readProgram(filename);
+    if (buf == NULL) return 1;
 
     /* Parse the program before eval(). */
     aoclactx *ctx = newInterpreter();
@@ -1196,14 +4815,9 @@ int evalFile(const char *filename, char **argv, int argc) {
 
     /* Before evaluating the program, let's push on the arguments
      * we received on the stack. */
-    for (int j = 0; j < argc; j++) {
-        obj *o = parseObject(NULL,argv[j],NULL,0);
-        if (!o) {
-            printf("Parsing command line argument: %s\n", ctx->errstr);
-            release(l);
-            return 1;
-        }
-        stackPush(ctx,o);
+    if (pushArguments(ctx,argv,argc)) {
+        release(l);
+        return 1;
     }
 
     /* Run the program. */
@@ -1213,6 +4827,9 @@ int evalFile(const char *filename, char **argv, int argc) {
     return retval;
 }
 
+/* Define AOCLA_NO_MAIN to use the interpreter as a library, like aoclac
+ * and the programs it generates do. */
+#ifndef AOCLA_NO_MAIN
 int main(int argc, char **argv) {
     if (argc == 1) {
         repl();
@@ -1221,3 +4838,4 @@ int main(int argc, char **argv) {
     }
     return 0;
 }
+#endif
@@ -0,0 +1,698 @@
+/* aoclac: Aocla to C compiler.
+ *
+ * aoclac translates an Aocla program into a C program that uses the
+ * interpreter as a runtime, so that it can be built into a standalone
+ * executable by the system C compiler:
+ *
+ *   ./aoclac program.aocla program.c
+ *   cc -O2 -I/path/to/aocla program.c -o program
+ *
+ * The generated program includes this file with AOCLA_RUNTIME_ONLY
+ * defined, getting the interpreter and the few functions of the runtime
+ * section below, but not the compiler.
+ *
+ * The program source is embedded in the executable and parsed at
+ * startup, so that literals are exactly the objects the interpreter
+ * would use. Each list defined as a procedure with the form
+ *
+ *   [...] 'name def
+ *
+ * is compiled into a C function, and so is the main program. Inside the
+ * functions:
+ *
+ * - Local vars are C variables.
+ * - Calls to a procedure that is still bound to a list compiled as a C
+ *   function are direct C calls.
+ * - Calls to builtins are direct calls to their C implementation, with
+ *   the arithmetic and comparison operators on integers done inline.
+ * - if, ifelse and while with literal lists become C control flow.
+ *
+ * Everything else (procedures defined at runtime, eval and upeval, map
+ * with a list built at runtime, and so forth) is executed by the VM,
+ * calling the procedure by name. Before such calls the C variables are
+ * stored in the stack frame, where the code run by the VM can access
+ * them, and are loaded back later, since the code may change them.
+ * Since the procedures compiled are still defined with their lists, code
+ * running in the VM calls them as usual Aocla procedures.
+ *
+ * Direct calls use the C stack: after AOC_MAX_DEPTH nested calls the
+ * calls go via the VM, that does not have this limit. Also note that
+ * only direct recursive calls in tail position reuse the frame like the
+ * VM does, so the stack traces of errors may show more procedures than
+ * the interpreter would. */
+
+#define AOCLA_NO_MAIN
+#include "aocla.c"
+
+/* ================================ Runtime =================================
+ * Functions called by the generated programs.
+ * ========================================================================== */
+
+#define AOC_MAX_DEPTH 1000      /* Max nested direct calls. */
+int AocDepth = 0;               /* Current nested direct calls. */
+
+/* Fill 'objs' with the objects of the program 'o' that are not integers
+ * or booleans, in depth first order, incrementing '*count' for each. If
+ * 'unquote' is true, quoted symbols and tuples are stored as unquoted
+ * copies, as the compiler does, since they are pushed on the stack in
+ * this form. The generated code refers to literals by their index. */
+void aocIndex(obj *o, obj **objs, int *count, int unquote) {
+    if (IS_IMMEDIATE(o)) return;
+    obj *copy = o;
+    if (unquote && ((o->type == OBJ_TYPE_SYMBOL && o->str.quoted) ||
+                    (o->type == OBJ_TYPE_TUPLE && o->l.quoted)))
+    {
+        copy = shallowCopy(o);
+        if (o->type == OBJ_TYPE_SYMBOL) copy->str.quoted = 0;
+        else copy->l.quoted = 0;
+    }
+    if (objs) objs[*count] = copy;
+    (*count)++;
+    if (o->type == OBJ_TYPE_LIST) {
+        for (size_t j = 0; j < o->l.len; j++)
+            aocIndex(listGet(o,j),objs,count,unquote);
+    }
+}
+
+/* Push 'o' on the stack, retaining it. */
+void aocPush(aoclactx *ctx, obj *o) {
+    stackPush(ctx,o);
+    retain(o);
+}
+
+/* Call the builtin 'p' like the VM does. Return 1 on error. */
+int aocBuiltin(aoclactx *ctx, aproc *p) {
+    aproc *prev = ctx->frame->curproc;
+    ctx->frame->curproc = p;
+    if (checkBuiltinArgs(ctx,p->builtin) || p->cproc(ctx)) return 1;
+    ctx->frame->curproc = prev;
+    return 0;
+}
+
+/* Call the arithmetic or comparison builtin 'p', computing the result
+ * inline if the operands are integers. Return 1 on error. */
+int aocOperator(aoclactx *ctx, aproc *p) {
+    if (ctx->stacklen < 2) return aocBuiltin(ctx,p);
+    obj *a = ctx->stack[ctx->stacklen-2], *b = ctx->stack[ctx->stacklen-1];
+    if (OBJ_TYPE(a) != OBJ_TYPE_INT || OBJ_TYPE(b) != OBJ_TYPE_INT)
+        return aocBuiltin(ctx,p);
+    int ai = INT_VALUE(a), bi = INT_VALUE(b);
+    obj *res;
+    switch(p->builtin->op) {
+    case '+': res = newInt(ai+bi); break;
+    case '-': res = newInt(ai-bi); break;
+    case '*': res = newInt(ai*bi); break;
+    case '/':
+        if (bi == 0) return aocBuiltin(ctx,p);
+        res = newInt(ai/bi);
+        break;
+    case '<': res = newBool(ai < bi); break;
+    case 'l': res = newBool(ai <= bi); break;
+    case '>': res = newBool(ai > bi); break;
+    case 'g': res = newBool(ai >= bi); break;
+    case '=': res = newBool(ai == bi); break;
+    case '!': res = newBool(ai != bi); break;
+    default: return aocBuiltin(ctx,p);
+    }
+    release(a);
+    release(b);
+    ctx->stacklen--;
+    ctx->stack[ctx->stacklen-1] = res;
+    return 0;
+}
+
+/* Call the procedure bound to the symbol 'sym' via the VM. The VM
+ * executes lists: '*call' caches the list [sym] to execute.
+ *
+ * When the call is the last instruction of the list, the VM does not
+ * restore the current procedure of the frame after builtins that run
+ * code, like foreach, so we do it here. */
+int aocCall(aoclactx *ctx, obj **call, obj *sym) {
+    if (*call == NULL) {
+        *call = newList();
+        (*call)->line = sym->line;
+        listAdd(*call,sym,LIST_TAIL);
+        retain(sym);
+    }
+    aproc *curproc = ctx->frame->curproc;
+    int retval = vmExec(ctx,getListCode(ctx,*call));
+    ctx->frame->curproc = curproc;
+    return retval;
+}
+
+/* Pop the boolean result of the condition of if, ifelse and while,
+ * reporting errors as the builtin 'p' would. Return 1 on error. */
+int aocCondition(aoclactx *ctx, aproc *p, int *res) {
+    ctx->frame->curproc = p;
+    if (checkStackType(ctx,1,OBJ_TYPE_BOOL)) return 1;
+    obj *o = stackPop(ctx);
+    *res = BOOL_VALUE(o);
+    return 0;
+}
+
+/* Execute a compiled program: 'src' is its source, 'objs' the array to
+ * fill with its objects, and 'entry' the C function of the program. */
+int aocRun(int argc, char **argv, const char *src, obj **objs,
+           int (*entry)(aoclactx *ctx))
+{
+    aoclactx *ctx = newInterpreter();
+    int line = 1, count = 0;
+    obj *l = parseObject(ctx,src,NULL,&line);
+    if (!l) {
+        printf("Parsing program: %s\n", ctx->errstr);
+        return 1;
+    }
+    aocIndex(l,objs,&count,1);
+    if (pushArguments(ctx,argv+1,argc-1)) return 1;
+    int retval = entry(ctx);
+    if (retval) printf("Runtime error: %s\n", ctx->errstr);
+    return retval;
+}
+
+#ifndef AOCLA_RUNTIME_ONLY
+/* =============================== Compiler =================================
+ * Code is generated walking the lists of the program. Each C function is
+ * first written into a memory buffer, so that we can declare only the
+ * variables and labels the code ended using.
+ * ========================================================================== */
+
+typedef struct gen {
+    obj **objs;             /* Objects of the program, see aocIndex(). */
+    int numobjs;
+    int *table;             /* Hash table: object pointer -> index+1. */
+    size_t tablesize;
+    obj **defs;             /* Lists defined as procedures. */
+    obj **defnames;         /* The symbols they are defined with. */
+    int *spill;             /* For each def, true if calling it requires
+                               the caller vars in the frame, see
+                               genFindSpills(). */
+    int numdefs;
+    /* State of the function being generated. */
+    FILE *out;
+    obj *fn;                /* List of the function, NULL for main. */
+    int vars[256];          /* Local vars used by the function. */
+    int numvars;
+    int indent;
+    int usedtop, usederr, usedcall, usedcond;
+} gen;
+
+size_t genHash(gen *g, obj *o) {
+    return ((uintptr_t)o >> 4) * 2654435761u % g->tablesize;
+}
+
+/* Return the index of the object 'o' in the objects array. */
+int genIndex(gen *g, obj *o) {
+    size_t h = genHash(g,o);
+    while(g->objs[g->table[h]-1] != o) h = (h+1) % g->tablesize;
+    return g->table[h]-1;
+}
+
+/* Write a line of code with the current indentation. */
+void genLine(gen *g, const char *fmt, ...) {
+    va_list ap;
+    fprintf(g->out,"%*s",g->indent*4,"");
+    va_start(ap,fmt);
+    vfprintf(g->out,fmt,ap);
+    va_end(ap);
+    fprintf(g->out,"\n");
+}
+
+/* Return true if 'o' is the unquoted symbol 'name'. */
+int isSymbol(obj *o, const char *name) {
+    return OBJ_TYPE(o) == OBJ_TYPE_SYMBOL && !o->str.quoted &&
+           !strcmp(o->str.ptr,name);
+}
+
+/* Mark in g->vars the vars used by the list 'l' and the nested ones. */
+void genFindVars(gen *g, obj *l) {
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        int type = OBJ_TYPE(o);
+        if (type == OBJ_TYPE_LIST) {
+            genFindVars(g,o);
+        } else if (type == OBJ_TYPE_TUPLE && !o->l.quoted) {
+            for (size_t i = 0; i < o->l.len; i++)
+                g->vars[(unsigned char)o->l.ele[i]->str.ptr[0]] = 1;
+        } else if (type == OBJ_TYPE_SYMBOL && !o->str.quoted &&
+                   o->str.ptr[0] == '$')
+        {
+            g->vars[(unsigned char)o->str.ptr[1]] = 1;
+        }
+    }
+}
+
+/* Store the C variables into the frame, before running code in the VM,
+ * and load them back after. */
+void genSpill(gen *g) {
+    for (int v = 0; v < 256; v++) {
+        if (!g->vars[v]) continue;
+        genLine(g,"if (v%d) { retain(v%d); setLocal(f,%d,v%d); }",v,v,v,v);
+    }
+}
+
+void genReload(gen *g) {
+    for (int v = 0; v < 256; v++) {
+        if (!g->vars[v]) continue;
+        genLine(g,"release(v%d); v%d = getLocal(f,%d); "
+                  "if (v%d) retain(v%d);",v,v,v,v,v);
+    }
+}
+
+/* Call the procedure bound to the symbol K[sym] via the VM. */
+void genVMCall(gen *g, int sym) {
+    genSpill(g);
+    genLine(g,"if (aocCall(ctx,&CL[%d],K[%d])) goto err;",sym,sym);
+    genReload(g);
+    g->usederr = 1;
+}
+
+/* Return the builtin named 'name', or NULL. */
+const builtin *genBuiltin(const char *name) {
+    for (const builtin *b = Builtins; b->name; b++)
+        if (!strcmp(b->name,name)) return b;
+    return NULL;
+}
+
+/* Generate the call of the symbol 'o'. 'tail' is true if nothing is left
+ * to execute in the function after the call. */
+void genCall(gen *g, obj *o, int tail) {
+    int sym = genIndex(g,o);
+    const builtin *b = genBuiltin(o->str.ptr);
+    int first = 1, direct = b && b->retc != BUILTIN_ANY_RET;
+
+    for (int j = 0; j < g->numdefs; j++)
+        if (!strcmp(g->defnames[j]->str.ptr,o->str.ptr)) direct = 1;
+    if (direct) {
+        genLine(g,"q = resolveProc(ctx,K[%d]);",sym);
+        g->usedcall = 1;
+    }
+    genLine(g,"f->curline = %d;",o->line);
+    g->usederr = 1;
+
+    /* Direct calls to the lists defined with this name. */
+    for (int j = 0; j < g->numdefs; j++) {
+        if (strcmp(g->defnames[j]->str.ptr,o->str.ptr)) continue;
+        obj *l = g->defs[j];
+        int idx = genIndex(g,l);
+        int spill = g->spill[j];
+        genLine(g,"%sif (q && q->proc == K[%d]%s) {",first ? "" : "} else ",
+            idx, l == g->fn ? "" : " && AocDepth < AOC_MAX_DEPTH");
+        first = 0;
+        g->indent++;
+        if (l == g->fn && tail && !spill) {
+            /* Recursive call in tail position: reuse the frame. */
+            for (int v = 0; v < 256; v++)
+                if (g->vars[v]) genLine(g,"release(v%d); v%d = NULL;",v,v);
+            genLine(g,"clearStackFrame(f,%d);",g->numvars);
+            genLine(g,"goto top;");
+            g->usedtop = 1;
+        } else {
+            /* Procedures that may run upeval access our frame. */
+            if (spill) genSpill(g);
+            genLine(g,"if (aoc_f%d(ctx,q)) goto err;",idx);
+            if (spill) genReload(g);
+        }
+        g->indent--;
+    }
+
+    /* Builtins that don't execute code. */
+    if (b && b->retc != BUILTIN_ANY_RET) {
+        genLine(g,"%sif (q && q->builtin && "
+                  "q->builtin->retc != BUILTIN_ANY_RET) {",
+                  first ? "" : "} else ");
+        first = 0;
+        g->indent++;
+        genLine(g,"if (%s(ctx,q)) goto err;",
+            b->op ? "aocOperator" : "aocBuiltin");
+        g->indent--;
+    }
+
+    if (first) {
+        genVMCall(g,sym);
+    } else {
+        genLine(g,"} else {");
+        g->indent++;
+        genVMCall(g,sym);
+        g->indent--;
+        genLine(g,"}");
+    }
+}
+
+void genList(gen *g, obj *l, int tail);
+
+/* Generate if, ifelse and while with literal lists: 'cond' and 'body'
+ * are the first two lists, 'other' the else branch of ifelse, 'o' the
+ * symbol called. If the symbol is no longer bound to the builtin, we
+ * push the lists and call it via the VM. */
+void genControl(gen *g, obj *cond, obj *body, obj *other, obj *o, int tail) {
+    int sym = genIndex(g,o);
+    const char *cproc = isSymbol(o,"while") ? "procWhile" :
+                        other ? "procIfElse" : "procIf";
+
+    genLine(g,"q = resolveProc(ctx,K[%d]);",sym);
+    genLine(g,"if (q && q->cproc == %s) {",cproc);
+    g->indent++;
+    genLine(g,"aproc *prev = f->curproc;");
+    genLine(g,"int res;");
+    genLine(g,"aproc *ctl = q;");
+    genLine(g,"f->curproc = ctl;");
+    g->usedcall = 1;
+    g->usederr = 1;
+    if (!strcmp(cproc,"procWhile")) {
+        genLine(g,"while(1) {");
+        g->indent++;
+        genLine(g,"f->curline = %d;",o->line);
+        genList(g,cond,0);
+        genLine(g,"if (aocCondition(ctx,ctl,&res)) goto err;");
+        genLine(g,"if (!res) break;");
+        genList(g,body,0);
+        g->indent--;
+        genLine(g,"}");
+    } else {
+        genLine(g,"f->curline = %d;",o->line);
+        genList(g,cond,0);
+        genLine(g,"if (aocCondition(ctx,ctl,&res)) goto err;");
+        genLine(g,"if (res) {");
+        g->indent++;
+        genList(g,body,tail);
+        g->indent--;
+        if (other) {
+            genLine(g,"} else {");
+            g->indent++;
+            genList(g,other,tail);
+            g->indent--;
+        }
+        genLine(g,"}");
+    }
+    genLine(g,"f->curproc = prev;");
+    g->indent--;
+    genLine(g,"} else {");
+    g->indent++;
+    genLine(g,"aocPush(ctx,K[%d]);",genIndex(g,cond));
+    genLine(g,"aocPush(ctx,K[%d]);",genIndex(g,body));
+    if (other) genLine(g,"aocPush(ctx,K[%d]);",genIndex(g,other));
+    genLine(g,"f->curline = %d;",o->line);
+    genVMCall(g,sym);
+    g->indent--;
+    genLine(g,"}");
+    g->usedcond = 1;
+}
+
+/* Generate the code of the list 'l'. If 'tail' is true, nothing is left
+ * to execute in the function after the list. */
+void genList(gen *g, obj *l, int tail) {
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        int last = tail && j == l->l.len-1;
+        int idx;
+
+        switch(OBJ_TYPE(o)) {
+        case OBJ_TYPE_INT:
+            genLine(g,"stackPush(ctx,newInt(%d));",INT_VALUE(o));
+            break;
+        case OBJ_TYPE_BOOL:
+            genLine(g,"stackPush(ctx,newBool(%d));",BOOL_VALUE(o));
+            break;
+        case OBJ_TYPE_LIST:
+            /* [cond] [body] while, [cond] [then] if and
+             * [cond] [then] [else] ifelse. */
+            if (j+2 < l->l.len &&
+                OBJ_TYPE(listGet(l,j+1)) == OBJ_TYPE_LIST &&
+                (isSymbol(listGet(l,j+2),"if") ||
+                 isSymbol(listGet(l,j+2),"while")))
+            {
+                genControl(g,o,listGet(l,j+1),NULL,listGet(l,j+2),
+                           tail && j+2 == l->l.len-1);
+                j += 2;
+                break;
+            }
+            if (j+3 < l->l.len &&
+                OBJ_TYPE(listGet(l,j+1)) == OBJ_TYPE_LIST &&
+                OBJ_TYPE(listGet(l,j+2)) == OBJ_TYPE_LIST &&
+                isSymbol(listGet(l,j+3),"ifelse"))
+            {
+                genControl(g,o,listGet(l,j+1),listGet(l,j+2),
+                           listGet(l,j+3),tail && j+3 == l->l.len-1);
+                j += 3;
+                break;
+            }
+            genLine(g,"aocPush(ctx,K[%d]);",genIndex(g,o));
+            break;
+        case OBJ_TYPE_TUPLE:
+            idx = genIndex(g,o);
+            if (o->l.quoted) {
+                genLine(g,"aocPush(ctx,K[%d]);",idx);
+                break;
+            }
+            genLine(g,"if (ctx->stacklen < %zu) {",o->l.len);
+            g->indent++;
+            genLine(g,"f->curline = %d;",o->line);
+            genLine(g,"setError(ctx,K[%d]->l.ele[ctx->stacklen]->str.ptr,"
+                      "\"Out of stack while capturing local\");",idx);
+            genLine(g,"goto err;");
+            g->indent--;
+            genLine(g,"}");
+            genLine(g,"ctx->stacklen -= %zu;",o->l.len);
+            for (size_t i = 0; i < o->l.len; i++) {
+                int v = (unsigned char)o->l.ele[i]->str.ptr[0];
+                genLine(g,"release(v%d); v%d = ctx->stack[ctx->stacklen+%zu];",
+                    v,v,i);
+            }
+            g->usederr = 1;
+            break;
+        case OBJ_TYPE_SYMBOL:
+            idx = genIndex(g,o);
+            if (o->str.quoted) {
+                genLine(g,"aocPush(ctx,K[%d]);",idx);
+            } else if (o->str.ptr[0] == '$') {
+                int v = (unsigned char)o->str.ptr[1];
+                genLine(g,"if (v%d == NULL) {",v);
+                g->indent++;
+                genLine(g,"f->curline = %d;",o->line);
+                genLine(g,"setError(ctx,K[%d]->str.ptr,"
+                          "\"Unbound local var\");",idx);
+                genLine(g,"goto err;");
+                g->indent--;
+                genLine(g,"}");
+                genLine(g,"aocPush(ctx,v%d);",v);
+                g->usederr = 1;
+            } else {
+                genCall(g,o,last);
+            }
+            break;
+        default:
+            genLine(g,"aocPush(ctx,K[%d]);",genIndex(g,o));
+            break;
+        }
+    }
+}
+
+/* Generate the C function for the list 'l', or for the main program if
+ * 'l' is NULL, in which case 'prog' is the program. */
+void genFunction(gen *g, FILE *out, obj *l, obj *prog) {
+    char *body;
+    size_t bodylen;
+
+    g->out = open_memstream(&body,&bodylen);
+    g->fn = l;
+    g->indent = 1;
+    g->usedtop = g->usederr = g->usedcall = g->usedcond = 0;
+    memset(g->vars,0,sizeof(g->vars));
+    genFindVars(g,l ? l : prog);
+    g->numvars = 0;
+    for (int v = 0; v < 256; v++) g->numvars += g->vars[v];
+    genList(g,l ? l : prog,l != NULL);
+    fclose(g->out);
+
+    g->out = out;
+    g->indent = 0;
+    if (l) {
+        genLine(g,"int aoc_f%d(aoclactx *ctx, aproc *p) {",genIndex(g,l));
+        g->indent++;
+        genLine(g,"stackframe *f = newStackFrame(ctx,%d);",g->numvars);
+    } else {
+        genLine(g,"int aoc_main(aoclactx *ctx) {");
+        g->indent++;
+        genLine(g,"stackframe *f = ctx->frame;");
+    }
+    for (int v = 0; v < 256; v++)
+        if (g->vars[v]) genLine(g,"obj *v%d = NULL;",v);
+    if (g->usedcall) genLine(g,"aproc *q;");
+    if (l) {
+        genLine(g,"ctx->frame = f;");
+        genLine(g,"AocDepth++;");
+        if (g->usedtop) fprintf(out,"top:\n");
+        genLine(g,"f->curproc = p;");
+    }
+    fwrite(body,bodylen,1,out);
+    free(body);
+
+    /* Return and error cleanup. */
+    for (int err = 0; err <= g->usederr; err++) {
+        if (err) fprintf(out,"err:\n");
+        for (int v = 0; v < 256; v++)
+            if (g->vars[v]) genLine(g,"release(v%d);",v);
+        if (l) {
+            genLine(g,"AocDepth--;");
+            genLine(g,"ctx->frame = f->prev;");
+            genLine(g,"freeStackFrame(ctx,f);");
+        }
+        genLine(g,"return %d;",err);
+    }
+    g->indent--;
+    genLine(g,"}");
+    genLine(g,"");
+}
+
+/* Find the lists defined as procedures in the form [...] 'name def. */
+void genFindDefs(gen *g, obj *l) {
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        if (OBJ_TYPE(o) != OBJ_TYPE_LIST) continue;
+        genFindDefs(g,o);
+        if (j+2 >= l->l.len) continue;
+        obj *name = listGet(l,j+1);
+        if (OBJ_TYPE(name) != OBJ_TYPE_SYMBOL || !name->str.quoted ||
+            !isSymbol(listGet(l,j+2),"def")) continue;
+        g->defs = myrealloc(g->defs,sizeof(obj*)*(g->numdefs+1));
+        g->defnames = myrealloc(g->defnames,sizeof(obj*)*(g->numdefs+1));
+        g->defs[g->numdefs] = o;
+        g->defnames[g->numdefs] = name;
+        g->numdefs++;
+    }
+}
+
+/* Return true if the list 'l', or a nested one, calls procedures via
+ * the VM, or calls a def already marked in g->spill. */
+int genCallsSpilling(gen *g, obj *l) {
+    for (size_t j = 0; j < l->l.len; j++) {
+        obj *o = listGet(l,j);
+        if (OBJ_TYPE(o) == OBJ_TYPE_LIST) {
+            if (genCallsSpilling(g,o)) return 1;
+            continue;
+        }
+        if (OBJ_TYPE(o) != OBJ_TYPE_SYMBOL || o->str.quoted ||
+            o->str.ptr[0] == '$') continue;
+
+        /* if, ifelse and while with literal lists are compiled inline,
+         * otherwise listRunsCode() already reported them. */
+        if (isSymbol(o,"if") || isSymbol(o,"ifelse") || isSymbol(o,"while"))
+            continue;
+        const builtin *b = genBuiltin(o->str.ptr);
+        int isdef = 0;
+        for (int i = 0; i < g->numdefs; i++) {
+            if (strcmp(g->defnames[i]->str.ptr,o->str.ptr)) continue;
+            if (g->spill[i]) return 1;
+            isdef = 1;
+        }
+        if (!isdef && (b == NULL || b->retc == BUILTIN_ANY_RET)) return 1;
+    }
+    return 0;
+}
+
+/* Mark in g->spill the defs whose C function may run code accessing the
+ * frame of its caller with upeval: directly, like the VM checks with
+ * listRunsCode(), or via the procedures it calls, since any code run
+ * by the VM, or by a def marked, may do so with nested upevals. Before
+ * calling them, the caller stores its C vars in the frame. */
+void genFindSpills(gen *g) {
+    g->spill = myalloc(sizeof(int)*(g->numdefs+1));
+    for (int j = 0; j < g->numdefs; j++)
+        g->spill[j] = listRunsCode(g->defs[j]);
+
+    int changed = 1;
+    while(changed) {
+        changed = 0;
+        for (int j = 0; j < g->numdefs; j++) {
+            if (g->spill[j] || !genCallsSpilling(g,g->defs[j])) continue;
+            g->spill[j] = 1;
+            changed = 1;
+        }
+    }
+}
+
+/* Write the program source as a C string literal. */
+void genSource(FILE *out, const char *src) {
+    fprintf(out,"const char *AocSource =\n    \"");
+    for (const char *p = src; *p; p++) {
+        unsigned char c = *p;
+        if (c == '\n') {
+            fprintf(out,"\\n\"\n    \"");
+        } else if (c == '"' || c == '\\') {
+            fprintf(out,"\\%c",c);
+        } else if (c < 32 || c > 126) {
+            fprintf(out,"\\%03o",c);
+        } else {
+            fputc(c,out);
+        }
+    }
+    fprintf(out,"\";\n\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr,"Usage: %s program.aocla program.c\n", argv[0]);
+        return 1;
+    }
+    char *src = readProgram(argv[1]);
+    if (src == NULL) return 1;
+    aoclactx *ctx = newInterpreter();
+    int line = 1;
+    obj *prog = parseObject(ctx,src,NULL,&line);
+    if (!prog) {
+        printf("Parsing program: %s\n", ctx->errstr);
+        return 1;
+    }
+
+    gen g;
+    memset(&g,0,sizeof(g));
+    aocIndex(prog,NULL,&g.numobjs,0);
+    g.objs = myalloc(sizeof(obj*)*(g.numobjs+1));
+    g.numobjs = 0;
+    aocIndex(prog,g.objs,&g.numobjs,0);
+    g.tablesize = g.numobjs*2+1;
+    g.table = myalloc(sizeof(int)*g.tablesize);
+    memset(g.table,0,sizeof(int)*g.tablesize);
+    for (int j = 0; j < g.numobjs; j++) {
+        size_t h = genHash(&g,g.objs[j]);
+        while(g.table[h]) {
+            if (g.objs[g.table[h]-1] == g.objs[j]) break;
+            h = (h+1) % g.tablesize;
+        }
+        if (!g.table[h]) g.table[h] = j+1;
+    }
+    genFindDefs(&g,prog);
+    genFindSpills(&g);
+
+    FILE *out = fopen(argv[2],"w");
+    if (!out) {
+        perror("Opening output file");
+        return 1;
+    }
+    fprintf(out,"/* Generated by aoclac from %s. */\n\n", argv[1]);
+    fprintf(out,"#define AOCLA_RUNTIME_ONLY\n#include \"aoclac.c\"\n\n");
+    genSource(out,src);
+    fprintf(out,"obj *K[%d];   /* Objects of the program. */\n",
+        g.numobjs+1);
+    fprintf(out,"obj *CL[%d];  /* Lists to call procedures via the VM. */\n\n",
+        g.numobjs+1);
+    for (int j = 0; j < g.numdefs; j++)
+        fprintf(out,"int aoc_f%d(aoclactx *ctx, aproc *p);\n",
+            genIndex(&g,g.defs[j]));
+    fprintf(out,"\n");
+    for (int j = 0; j < g.numdefs; j++) {
+        /* The same list may be defined more than once. */
+        int k;
+        for (k = 0; k < j; k++) if (g.defs[k] == g.defs[j]) break;
+        if (k == j) genFunction(&g,out,g.defs[j],NULL);
+    }
+    genFunction(&g,out,NULL,prog);
+    fprintf(out,"int main(int argc, char **argv) {\n"
+                "    return aocRun(argc,argv,AocSource,K,aoc_main);\n}\n");
+    if (fclose(out) == EOF) {
+        perror("Writing output file");
+        return 1;
+    }
+    return 0;
+}
+#endif
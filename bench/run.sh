@@ -0,0 +1,19 @@
+#!/bin/bash
+# Run the benchmarks with each of the interpreters given as arguments,
+# reporting the best user+sys time of five runs.
+#
+# Usage: bench/run.sh ./aocla-a ./aocla-b ...
+
+dir=$(dirname "$0")
+TIMEFORMAT='%3U %3S'
+for script in "$dir"/*.aocla; do
+    for bin in "$@"; do
+        best=
+        for run in 1 2 3 4 5; do
+            t=$( { time "$bin" "$script" > /dev/null; } 2>&1 |
+                 awk '{printf "%d", ($1+$2)*1000}')
+            if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+        done
+        printf "%-12s %-24s %6d ms\n" "$(basename "$script")" "$bin" "$best"
+    done
+done